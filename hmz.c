@@ -16,8 +16,6 @@
 
 #include "hmz.h"
 
-#define HMZ_NO_COMPRESSION (0x80000000UL)
-
 #define true	1
 #define false	0
 
@@ -29,6 +27,7 @@ struct compress_args {
 	char filename_out[MAXPATHLEN];
 	unsigned int compress;
 	unsigned int format;
+	unsigned int flags;
 	unsigned int chunk_size;
 	unsigned int console;
 	unsigned int clobber;
@@ -37,23 +36,37 @@ struct compress_args {
 	unsigned int benchmark;
 	unsigned int verbose;
 	unsigned int test;
+	unsigned int checksum;
 	unsigned int bench_tests;
+	unsigned int bench_cpus;
+	unsigned int bench_histogram;
+	const char *pattern;
 };
 
 static void
 usage(void)
 {
 	printf("usage: hmz [options] <files...>\n");
+	printf("	-a		benchmark each supported cpu kernel set\n");
 	printf("	-c		write output to stdout\n");
 	printf("	-b <tests>	benchmark mode\n");
 	printf("	-d		decompress file\n");
+	printf("	-e <pattern>	count matches of pattern in compressed file\n");
 	printf("	-f		overwrite output file\n");
+	printf("	-g		order 1 context class tables\n");
+	printf("	-i		store a checksum of each chunk\n");
+	printf("	-j		encode the four streams in one loop\n");
 	printf("	-k		keep input file\n");
+	printf("	-l		benchmark only the encoder's histogram\n");
 	printf("	-m		multi stream mode (default)\n");
+	printf("	-n <streams>	interleaved streams (1, 4, 8 or 16)\n");
+	printf("	-o		optimal length limited codes\n");
+	printf("	-p		reuse the previous chunk's table\n");
 	printf("	-r		recurse into directories\n");
 	printf("	-s		single stream mode\n");
 	printf("	-t		test compressed file\n");
 	printf("	-v		be verbose\n");
+	printf("	-w <bytes>	element width for delta and shuffle filters\n");
 	printf("	-h		this help message\n");
 	printf("	-x <size>	chunk size for compression (KB)\n");
 }
@@ -112,6 +125,7 @@ compress_fd(const int fd_in, const int fd_out,
 	unsigned int size_flag;
 	unsigned int write_size;
 	unsigned int header;
+	unsigned int crc;
 	int ret;
 
 	ret = posix_memalign((void **)&buffer_in, pagesize, args->chunk_size);
@@ -130,14 +144,15 @@ compress_fd(const int fd_in, const int fd_out,
 		goto out;
 	}
 
-	ret = hmz_encode_init(&state, args->format);
+	ret = hmz_encode_init(&state, args->format | args->flags,
+	    args->chunk_size);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init hmz: %s\n",
 		    args->filename, strerror(ret));
 		goto out;
 	}
 
-	header = HEADER_VALUE;
+	header = (args->checksum == true) ? HEADER_CRC_VALUE : HEADER_VALUE;
 	ret = write_data(fd_out, &header, sizeof(header));
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to write data: %s\n",
@@ -196,6 +211,18 @@ compress_fd(const int fd_in, const int fd_out,
 			goto out;
 		}
 
+		if (args->checksum == true) {
+			crc = hmz_crc32c(0, buffer_in, size_in);
+			ret = write_data(fd_out, &crc, sizeof(crc));
+			if (ret != 0) {
+				fprintf(stderr,
+				    "File %s: failed to write data: %s\n",
+				    args->filename_out, strerror(ret));
+				goto out;
+			}
+			total_out += sizeof(crc);
+		}
+
 		ret = write_data(fd_out, write_buffer, size_out);
 		if (ret != 0) {
 			fprintf(stderr, "File %s: failed to write data: %s\n",
@@ -232,6 +259,7 @@ decompress_fd(const int fd_in, const int fd_out,
     struct compress_args * const args)
 {
 	struct hmz_decode_state *state = NULL;
+	struct hmz_find find;
 	unsigned char *buffer_in = NULL;
 	unsigned char *buffer_out = NULL;
 	unsigned char *write_buffer = NULL;
@@ -242,6 +270,9 @@ decompress_fd(const int fd_in, const int fd_out,
 	unsigned int header;
 	unsigned int bytes;
 	unsigned int no_compression;
+	unsigned int checksum;
+	unsigned int crc_in;
+	unsigned int crc;
 	int ret;
 
 	bytes = sizeof(header);
@@ -261,7 +292,7 @@ decompress_fd(const int fd_in, const int fd_out,
 
 	total_in += bytes;
 
-	if (header != HEADER_VALUE) {
+	if (header != HEADER_VALUE && header != HEADER_CRC_VALUE) {
 		ret = EINVAL;
 		fprintf(stderr, "File %s: bad header value\n",
 		    args->filename);
@@ -284,6 +315,7 @@ decompress_fd(const int fd_in, const int fd_out,
 	}
 
 	total_in += bytes;
+	checksum = (header == HEADER_CRC_VALUE);
 
 	if (args->chunk_size == 0) {
 		ret = EINVAL;
@@ -310,13 +342,17 @@ decompress_fd(const int fd_in, const int fd_out,
 		goto out;
 	}
 
-	ret = hmz_decode_init(&state);
+	ret = hmz_decode_init(&state, args->chunk_size);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init hmz: %s\n",
 		    args->filename, strerror(ret));
 		goto out;
 	}
 
+	if (args->pattern != NULL)
+		hmz_find_init(&find, (const unsigned char *)args->pattern,
+		    strlen(args->pattern));
+
 	for (;;) {
 
 		bytes = sizeof(size_in);
@@ -353,6 +389,26 @@ decompress_fd(const int fd_in, const int fd_out,
 			goto out;
 		}
 
+		if (checksum) {
+			bytes = sizeof(crc_in);
+			ret = read_data(fd_in, &crc_in, &bytes);
+			if (ret != 0) {
+				fprintf(stderr,
+				    "File %s: failed to read data: %s\n",
+				    args->filename, strerror(ret));
+				goto out;
+			}
+
+			if (bytes != sizeof(crc_in)) {
+				ret = EIO;
+				fprintf(stderr, "File %s: unexpected eof\n",
+				    args->filename);
+				goto out;
+			}
+
+			total_in += bytes;
+		}
+
 		bytes = size_in;
 		ret = read_data(fd_in, buffer_in, &bytes);
 		if (ret != 0) {
@@ -369,9 +425,23 @@ decompress_fd(const int fd_in, const int fd_out,
 		}
 
 		size_out = args->chunk_size;
-		if (!no_compression) {
-			ret = hmz_decode(state, buffer_in, size_in,
-			    buffer_out, &size_out);
+		if (args->pattern != NULL && !no_compression) {
+			ret = hmz_decode_scan(state, buffer_in, size_in,
+			    buffer_out, &size_out, hmz_scan_find, &find,
+			    checksum ? &crc : NULL);
+			if (ret != 0) {
+				fprintf(stderr,
+				    "File %s: failed to decode data: %s\n",
+				    args->filename, strerror(ret));
+				goto out;
+			}
+		} else if (!no_compression) {
+			if (checksum)
+				ret = hmz_decode_crc(state, buffer_in, size_in,
+				    buffer_out, &size_out, &crc);
+			else
+				ret = hmz_decode(state, buffer_in, size_in,
+				    buffer_out, &size_out);
 			if (ret != 0) {
 				fprintf(stderr,
 				    "File %s: failed to decode data: %s\n",
@@ -380,7 +450,19 @@ decompress_fd(const int fd_in, const int fd_out,
 			}
 			write_buffer = buffer_out;
 		} else {
+			size_out = size_in;
+			if (checksum)
+				crc = hmz_crc32c(0, buffer_in, size_in);
 			write_buffer = buffer_in;
+			if (args->pattern != NULL)
+				hmz_scan_find(&find, buffer_in, size_in);
+		}
+
+		if (checksum && crc != crc_in) {
+			ret = EIO;
+			fprintf(stderr, "File %s: checksum mismatch at %ld\n",
+			    args->filename, total_out);
+			goto out;
 		}
 
 		if (args->test == false) {
@@ -397,6 +479,9 @@ decompress_fd(const int fd_in, const int fd_out,
 		total_out += size_out;
 	}
 
+	if (args->pattern != NULL)
+		printf("%s: %lu\n", args->filename, find.matches);
+
 	ret = 0;
 
  out:
@@ -491,6 +576,56 @@ synctime(void)
 	while (clock() == ts_start);
 }
 
+static const unsigned int cpu_sets[] = {
+	0,
+	HMZ_CPU_BMI2,
+	HMZ_CPU_BMI2 | HMZ_CPU_AVX2,
+	HMZ_CPU_BMI2 | HMZ_CPU_AVX2 | HMZ_CPU_AVX512,
+};
+
+static const char *
+cpu_name(const unsigned int features)
+{
+	if (features & HMZ_CPU_AVX512)
+		return "avx512";
+	if (features & HMZ_CPU_AVX2)
+		return "avx2";
+	if (features & HMZ_CPU_BMI2)
+		return "bmi2";
+	return "generic";
+}
+
+static const struct {
+	unsigned int feature;
+	const char *name;
+} cpu_features[] = {
+	{ HMZ_CPU_SSE42, "sse4.2" },
+	{ HMZ_CPU_BMI2, "bmi2" },
+	{ HMZ_CPU_AVX2, "avx2" },
+	{ HMZ_CPU_AVX512, "avx512" },
+};
+
+/*
+ * Report the kernel set the library picked for this cpu and the
+ * features it was built from.
+ */
+static void
+print_kernels(void)
+{
+	const unsigned int features = hmz_cpu_features();
+	const char *sep = "";
+	unsigned int i;
+
+	printf("Kernels: %s (", cpu_name(features));
+	for (i = 0; i < sizeof(cpu_features) / sizeof(cpu_features[0]); i++) {
+		if (features & cpu_features[i].feature) {
+			printf("%s%s", sep, cpu_features[i].name);
+			sep = " ";
+		}
+	}
+	printf(")\n");
+}
+
 struct chunk {
 	unsigned char *data_orig;
 	unsigned char *data_comp;
@@ -499,6 +634,7 @@ struct chunk {
 	unsigned int size_comp;
 	unsigned int size_comp_out;
 	unsigned int size_decomp_out;
+	unsigned int crc;
 };
 
 static unsigned int
@@ -514,6 +650,7 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 	unsigned long ts_start;
 	unsigned long iterations;
 	unsigned long time;
+	unsigned int crc = 0;
 	unsigned int t;
 	unsigned int c;
 	unsigned int ret;
@@ -530,7 +667,8 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 	}
 
 	comp_rate = 0;
-	ret = hmz_encode_init(&estate, args->format);
+	ret = hmz_encode_init(&estate, args->format | args->flags,
+	    args->chunk_size);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init hmz: %s\n",
 		    args->filename, strerror(ret));
@@ -544,7 +682,12 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 		ts_start = gettime();
 
 		do {
+			hmz_encode_reset(estate);
 			for (c = 0; c < nchunks; c++) {
+				if (args->checksum == true)
+					chunks[c].crc = hmz_crc32c(0,
+					    chunks[c].data_orig,
+					    chunks[c].size_orig);
 				chunks[c].size_comp_out = chunks[c].size_comp;
 				ret = hmz_encode(estate, chunks[c].data_orig,
 				    chunks[c].size_orig, chunks[c].data_comp,
@@ -593,7 +736,7 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 	comp_perc = (double)(comp_size * 100) / (double)args->st->st_size;
 
 	decomp_rate = 0;
-	ret = hmz_decode_init(&dstate);
+	ret = hmz_decode_init(&dstate, args->chunk_size);
 	if (ret != 0) {
 		fprintf(stderr, "File %s: failed to init hmz: %s\n",
 		    args->filename, strerror(ret));
@@ -607,12 +750,24 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 		ts_start = gettime();
 
 		do {
+			hmz_decode_reset(dstate);
 			for (c = 0; c < nchunks; c++) {
 				chunks[c].size_decomp_out = chunks[c].size_orig;
-				ret = hmz_decode(dstate, chunks[c].data_comp,
-				    chunks[c].size_comp_out,
-				    chunks[c].data_decomp,
-				    &chunks[c].size_decomp_out);
+				if (args->checksum == true)
+					ret = hmz_decode_crc(dstate,
+					    chunks[c].data_comp,
+					    chunks[c].size_comp_out,
+					    chunks[c].data_decomp,
+					    &chunks[c].size_decomp_out, &crc);
+				else
+					ret = hmz_decode(dstate,
+					    chunks[c].data_comp,
+					    chunks[c].size_comp_out,
+					    chunks[c].data_decomp,
+					    &chunks[c].size_decomp_out);
+				if (ret == 0 && args->checksum == true &&
+				    crc != chunks[c].crc)
+					ret = EIO;
 				if (ret != 0) {
 					fprintf(stderr,
 					"File %s: failed to decode data: %s\n",
@@ -642,8 +797,19 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 
 	hmz_decode_finish(dstate);
 
-	printf("Format %d: --> %lu, %9.4f%%, %10.4f MB/s, %10.4f MB/s\n",
-	    args->format, comp_size, comp_perc, comp_rate, decomp_rate);
+	if (args->bench_cpus == true)
+		printf("Format %d (%s): --> %lu, %9.4f%%, %10.4f MB/s, "
+		    "%10.4f MB/s\n", args->format, cpu_name(hmz_cpu_features()),
+		    comp_size, comp_perc, comp_rate, decomp_rate);
+	else
+		printf("Format %d: --> %lu, %9.4f%%, %10.4f MB/s, "
+		    "%10.4f MB/s\n", args->format, comp_size, comp_perc,
+		    comp_rate, decomp_rate);
+
+	if (args->verbose == true)
+		printf("Chunks %u: %10.4f us/chunk, %10.4f us/chunk\n", nchunks,
+		    (double)args->st->st_size / nchunks / comp_rate,
+		    (double)args->st->st_size / nchunks / decomp_rate);
 
 	decomp_size = 0;
 	for (c = 0; c < nchunks; c++) {
@@ -685,6 +851,72 @@ benchmark_format(struct compress_args * const args, struct chunk *chunks,
 	return ret;
 }
 
+/*
+ * Time the histogram the encoder builds of each chunk on its own, to
+ * compare the kernel sets with -a.
+ */
+static unsigned int
+benchmark_histogram(struct compress_args * const args, struct chunk *chunks,
+    unsigned int nchunks)
+{
+	struct hmz_encode_state *state = NULL;
+	unsigned int counts[256];
+	double rate;
+	double best_rate;
+	unsigned long ts_start;
+	unsigned long iterations;
+	unsigned long time;
+	unsigned int t;
+	unsigned int c;
+	unsigned int ret;
+
+	ret = hmz_encode_init(&state, args->format | args->flags,
+	    args->chunk_size);
+	if (ret != 0) {
+		fprintf(stderr, "File %s: failed to init hmz: %s\n",
+		    args->filename, strerror(ret));
+		goto out;
+	}
+
+	best_rate = 0;
+	for (t = 0; t < args->bench_tests; t++) {
+
+		iterations = 0;
+		synctime();
+		ts_start = gettime();
+
+		do {
+			for (c = 0; c < nchunks; c++)
+				hmz_encode_histogram(state, chunks[c].data_orig,
+				    chunks[c].size_orig, counts);
+
+			time = gettime() - ts_start;
+			iterations++;
+
+		} while (time < BENCH_TIME);
+
+		rate = (double)(args->st->st_size * iterations * 1000) /
+		    (double)time;
+		if (rate > best_rate)
+			best_rate = rate;
+
+		if (args->verbose == true) {
+			printf("%10.4f ", rate);
+			fflush(stdout);
+		}
+	}
+
+	if (args->verbose == true)
+		printf("\n");
+
+	printf("Histogram (%s): %10.4f MB/s\n", cpu_name(hmz_cpu_features()),
+	    best_rate);
+
+ out:
+	hmz_encode_finish(state);
+	return ret;
+}
+
 static unsigned int
 benchmark_init_chunk(const int fd_in, struct chunk * const chunk,
     const unsigned int chunk_size, struct compress_args * const args)
@@ -745,6 +977,7 @@ benchmark(const int fd_in, struct compress_args * const args)
 	cpu_set_t cpuset;
 	off_t bytes_left;
 	unsigned int chunk_size;
+	unsigned int features;
 	unsigned int c;
 	unsigned int nchunks;
 	unsigned int ret;
@@ -790,7 +1023,25 @@ benchmark(const int fd_in, struct compress_args * const args)
 	printf("File %s: size %lu bytes, chunk %u bytes\n",
 	    args->filename, args->st->st_size, args->chunk_size);
 
-	benchmark_format(args, chunks, nchunks);
+	if (args->bench_cpus == false) {
+		if (args->bench_histogram == true)
+			benchmark_histogram(args, chunks, nchunks);
+		else
+			benchmark_format(args, chunks, nchunks);
+		goto out;
+	}
+
+	features = hmz_cpu_features();
+	for (c = 0; c < sizeof(cpu_sets) / sizeof(cpu_sets[0]); c++) {
+		if ((cpu_sets[c] & features) != cpu_sets[c])
+			continue;
+		hmz_set_cpu_features(cpu_sets[c]);
+		if (args->bench_histogram == true)
+			benchmark_histogram(args, chunks, nchunks);
+		else
+			benchmark_format(args, chunks, nchunks);
+	}
+	hmz_set_cpu_features(features);
 
  out:
 	if (chunks != NULL) {
@@ -1074,6 +1325,7 @@ main(int argc, char **argv)
 	int c;
 
 	args.format = HMZ_FMT_MULTI;
+	args.flags = 0;
 	args.compress = true;
 	args.console = false;
 	args.clobber = false;
@@ -1082,11 +1334,18 @@ main(int argc, char **argv)
 	args.benchmark = false;
 	args.verbose = false;
 	args.test = false;
+	args.checksum = false;
 	args.chunk_size = HMZ_DEF_CHUNK;
 	args.bench_tests = BENCH_TESTS;
+	args.bench_cpus = false;
+	args.bench_histogram = false;
+	args.pattern = NULL;
 
-	while ((c = getopt(argc, argv, "b:cdfhkmrstvx:")) != EOF) {
+	while ((c = getopt(argc, argv, "ab:cde:fghijklmn:oprstvw:x:")) != EOF) {
 		switch (c) {
+		case 'a':
+			args.bench_cpus = true;
+			break;
 		case 'b':
 			args.benchmark = true;
 			args.bench_tests = strtoul(optarg, NULL, 0);
@@ -1101,15 +1360,62 @@ main(int argc, char **argv)
 		case 'd':
 			args.compress = false;
 			break;
+		case 'e':
+			if (strlen(optarg) == 0 || strlen(optarg) > HMZ_FIND_MAX) {
+				printf("Pattern must be 1 to %d bytes.\n",
+				    HMZ_FIND_MAX);
+				exit(1);
+			}
+			args.pattern = optarg;
+			args.compress = false;
+			args.test = true;
+			break;
 		case 'f':
 			args.clobber = true;
 			break;
+		case 'g':
+			args.flags |= HMZ_FLAG_CONTEXT;
+			break;
+		case 'i':
+			args.checksum = true;
+			break;
+		case 'j':
+			args.flags |= HMZ_FLAG_INTERLEAVE;
+			break;
 		case 'k':
 			args.remove = false;
 			break;
+		case 'l':
+			args.bench_histogram = true;
+			break;
 		case 'm':
 			args.format = HMZ_FMT_MULTI;
 			break;
+		case 'n':
+			switch (strtoul(optarg, NULL, 0)) {
+			case 1:
+				args.format = HMZ_FMT_SINGLE;
+				break;
+			case 4:
+				args.format = HMZ_FMT_MULTI;
+				break;
+			case 8:
+				args.format = HMZ_FMT_MULTI8;
+				break;
+			case 16:
+				args.format = HMZ_FMT_MULTI16;
+				break;
+			default:
+				printf("Streams must be 1, 4, 8 or 16.\n");
+				exit(1);
+			}
+			break;
+		case 'o':
+			args.flags |= HMZ_FLAG_OPTIMAL;
+			break;
+		case 'p':
+			args.flags |= HMZ_FLAG_REUSE;
+			break;
 		case 'r':
 			args.recurse = true;
 			break;
@@ -1122,6 +1428,20 @@ main(int argc, char **argv)
 		case 'v':
 			args.verbose = true;
 			break;
+		case 'w':
+			switch (strtoul(optarg, NULL, 0)) {
+			case 1:
+			case 2:
+			case 4:
+			case 8:
+				args.flags &= ~HMZ_WIDTH_MASK;
+				args.flags |= HMZ_WIDTH(strtoul(optarg, NULL, 0));
+				break;
+			default:
+				printf("Width must be 1, 2, 4 or 8.\n");
+				exit(1);
+			}
+			break;
 		case 'x':
 			args.chunk_size = strtoul(optarg, NULL, 0);
 			if (args.chunk_size > HMZ_MAX_CHUNK) {
@@ -1142,7 +1462,12 @@ main(int argc, char **argv)
 	if (pagesize <= 0)
 		pagesize = 4096;
 
+	if (args.verbose == true && args.console == false)
+		print_kernels();
+
 	if (optind == argc) {
+		if (args.verbose == true)
+			return 0;
 		usage();
 		exit(1);
 	}
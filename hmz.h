@@ -4,22 +4,86 @@ extern "C" {
 
 #define SUFFIX		".hmz"
 #define HEADER_VALUE	0x315A4D48
+#define HEADER_CRC_VALUE	0x435A4D48
 
 #define HMZ_FMT_SINGLE	0
 #define HMZ_FMT_MULTI	1
+#define HMZ_FMT_MULTI8	2
+#define HMZ_FMT_MULTI16	3
+#define HMZ_FMT_MASK	3
+
+#define HMZ_FLAG_REUSE	(1<<4)
+#define HMZ_FLAG_OPTIMAL	(1<<5)
+#define HMZ_FLAG_CONTEXT	(1<<6)
+#define HMZ_FLAG_INTERLEAVE	(1<<7)
+
+#define HMZ_WIDTH_SHIFT	8
+#define HMZ_WIDTH_MASK	(0xF<<HMZ_WIDTH_SHIFT)
+#define HMZ_WIDTH(bytes)	((bytes)<<HMZ_WIDTH_SHIFT)
+
+#define HMZ_ESTIMATE_SAMPLE	(1<<0)
+
+#define HMZ_TAG_LITS	0
+#define HMZ_TAG_RLE	1
+#define HMZ_TAG_LENS	2
+#define HMZ_TAG_CANON	3
+#define HMZ_TAG_SPLIT	4
+#define HMZ_TAG_BITPACK	5
+#define HMZ_TAG_ANS	6
+#define HMZ_TAG_RUNS	7
+#define HMZ_TAG_FILTER	8
 
 #define HMZ_DEF_CHUNK	(1<<15)
 #define HMZ_MAX_CHUNK	(1<<30)
 
+#define HMZ_STATE_ALIGN	64
+
+#define HMZ_NO_COMPRESSION	(0x80000000UL)
+
+#define HMZ_CPU_AVX2	(1<<0)
+#define HMZ_CPU_AVX512	(1<<1)
+#define HMZ_CPU_SSE42	(1<<2)
+#define HMZ_CPU_BMI2	(1<<3)
+
+#define HMZ_FIND_MAX	64
+
 struct hmz_encode_state;
 struct hmz_decode_state;
 
+struct hmz_find {
+	const unsigned char *pattern;
+	unsigned int  length;
+	unsigned int  carry;
+	unsigned long offset;
+	unsigned long next;
+	unsigned long matches;
+	unsigned long first;
+	unsigned char tail[HMZ_FIND_MAX];
+};
+
+unsigned int hmz_cpu_features(void);
+
+unsigned int hmz_set_cpu_features(
+    const unsigned int features);
+
 unsigned int hmz_compressed_size(
     const unsigned int);
 
+unsigned int hmz_encode_state_size(
+    const unsigned int format,
+    const unsigned int chunk_size);
+
 unsigned int hmz_encode_init(
     struct hmz_encode_state ** const state,
-    const unsigned int format);
+    const unsigned int format,
+    const unsigned int chunk_size);
+
+unsigned int hmz_encode_init_mem(
+    struct hmz_encode_state ** const state,
+    void * const mem,
+    const unsigned int size,
+    const unsigned int format,
+    const unsigned int chunk_size);
 
 unsigned int hmz_encode(
     struct hmz_encode_state * const state,
@@ -28,11 +92,38 @@ unsigned int hmz_encode(
     unsigned char * const buffer_out,
     unsigned int * const size_out);
 
+unsigned int hmz_encode_estimate(
+    struct hmz_encode_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned int * const size_out,
+    unsigned int * const tag,
+    const unsigned int flags);
+
+unsigned int hmz_encode_histogram(
+    struct hmz_encode_state * const state,
+    const unsigned char * const buffer,
+    const unsigned int size,
+    unsigned int * const counts);
+
+unsigned int hmz_encode_reset(
+    struct hmz_encode_state * const state);
+
 unsigned int hmz_encode_finish(
     const struct hmz_encode_state * const state);
 
+unsigned int hmz_decode_state_size(
+    const unsigned int chunk_size);
+
 unsigned int hmz_decode_init(
-    struct hmz_decode_state ** const state);
+    struct hmz_decode_state ** const state,
+    const unsigned int chunk_size);
+
+unsigned int hmz_decode_init_mem(
+    struct hmz_decode_state ** const state,
+    void * const mem,
+    const unsigned int size,
+    const unsigned int chunk_size);
 
 unsigned int hmz_decode(
     struct hmz_decode_state * const state,
@@ -41,9 +132,78 @@ unsigned int hmz_decode(
     unsigned char * const buffer_out,
     unsigned int * const size_out);
 
+unsigned int hmz_decode_crc(
+    struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    unsigned int * const crc);
+
+unsigned int hmz_decode_scan(
+    struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out,
+    unsigned int (* const scan)(void *, const unsigned char *, unsigned int),
+    void * const arg,
+    unsigned int * const crc);
+
+unsigned int hmz_decode_range(
+    struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in,
+    const unsigned int size_in,
+    const unsigned int offset,
+    unsigned char * const buffer_out,
+    unsigned int * const size_out);
+
+unsigned int hmz_decode_reset(
+    struct hmz_decode_state * const state);
+
 unsigned int hmz_decode_finish(
     const struct hmz_decode_state * const state);
 
+unsigned int hmz_crc32c(
+    const unsigned int crc,
+    const unsigned char * const buffer,
+    const unsigned int size);
+
+unsigned int hmz_find_init(
+    struct hmz_find * const find,
+    const unsigned char * const pattern,
+    const unsigned int length);
+
+unsigned int hmz_scan_find(
+    void * const arg,
+    const unsigned char * const data,
+    const unsigned int size);
+
+unsigned int hmz_scan_histogram(
+    void * const arg,
+    const unsigned char * const data,
+    const unsigned int size);
+
+unsigned long hmz_buffer_bound(
+    const unsigned long size,
+    const unsigned int chunk_size);
+
+unsigned int hmz_encode_buffer(
+    const unsigned char * const buffer_in,
+    const unsigned long size_in,
+    unsigned char * const buffer_out,
+    unsigned long * const size_out,
+    const unsigned int chunk_size,
+    const unsigned int format,
+    const unsigned int threads);
+
+unsigned int hmz_decode_buffer(
+    const unsigned char * const buffer_in,
+    const unsigned long size_in,
+    unsigned char * const buffer_out,
+    unsigned long * const size_out,
+    const unsigned int threads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,16 +1,118 @@
-#define MEM_ALIGN		64
+#define MEM_ALIGN		HMZ_STATE_ALIGN
+#define MEM_ROUND(size)		(((size) + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1UL))
 #define SYMBOLS			256
-#define MAX_CODE_LEN		12
-#define TABLE_SIZE		(1 << MAX_CODE_LEN)
+#define MAX_CODE_LEN		14
+#define TABLE_BITS		12
+#define TABLE_SIZE		((1 << TABLE_BITS) + \
+				    (SYMBOLS << (MAX_CODE_LEN - TABLE_BITS)))
 #define MIN_HEADER_SIZE		(1 + 1 + 4)
-#define MAX_HEADER_SIZE		(1 + MAX_CODE_LEN + SYMBOLS + 20)
+#define MAX_STREAMS		16
+#define MAX_STREAMS_SIZE	(1 + 4 * (MAX_STREAMS + 1))
+#define MAX_HEADER_SIZE		(1 + MAX_CODE_LEN + SYMBOLS + MAX_STREAMS_SIZE)
 #define MEM_OVERRUN		8
+#define STREAM_MIN		64
+#define FORMAT_STREAMS(format)	((format) == HMZ_FMT_SINGLE ? 1U : 2U << (format))
+#define COUNT_LANES		8
+#define COUNT_SHORT_MAX		(1 << 16)
+#define COUNT_PROBES		4
+#define COUNT_PROBE		64
+#define COUNT_REPEATS		96
+#define COUNT_PROBE_MIN		(1 << 12)
+#define LOG2_SHIFT		16
+#define SAMPLE_BLOCKS		64
+#define SAMPLE_BLOCK		64
+#define SAMPLE_SIZE		(SAMPLE_BLOCKS * SAMPLE_BLOCK)
+#define SAMPLE_MIN		(SAMPLE_SIZE * 8)
+#define SAMPLE_BIAS		47274
+#define SAMPLE_SAVING		6
+#define ESTIMATE_OVERFLOW	(~0UL)
 
 #define TAG_LITS		0
 #define TAG_RLE			1
 #define TAG_LENS		2
 #define TAG_CANON		3
 
+#define EXT_LENGTH		0
+#define EXT_TAG			((TAG_LENS << 6) | EXT_LENGTH)
+#define EXT_SPLIT		0
+#define EXT_CONTEXT		1
+#define EXT_BITPACK		2
+#define EXT_ANS			3
+#define EXT_FILTER		4
+#define EXT_RUNS		5
+#define EXT_INDEX		6
+
+#define REUSE_LENGTH		0
+#define REUSE_SHIFT		7
+#define REUSE_AGE		4
+
+#define LENGTH_MIN		10
+#define LENGTH_SHIFT		7
+#define LENGTH_TABLE_SHIFT	3
+
+#define SPLIT_MIN		(1 << 17)
+#define SPLIT_BLOCKS		32
+#define SPLIT_SAMPLE		64
+#define SPLIT_SHIFT		4
+#define SPLIT_OVERHEAD		64
+#define SPLIT_HEADER_SIZE(parts)	(1 + 1 + 1 + 4 * (parts))
+#define INDEX_HEADER_SIZE(parts)	(SPLIT_HEADER_SIZE(parts) + 4 * (parts))
+
+#define CONTEXT_MAX_LEN		12
+#define CONTEXT_CLASSES		16
+#define CONTEXT_ENTRIES		(1 << 14)
+#define CONTEXT_ITERATIONS	2
+#define CONTEXT_SAVING		5
+#define CONTEXT_MIN		(1 << 12)
+#define CONTEXT_HEADER_SIZE	(1 + 1 + 1 + 1 + (SYMBOLS >> 1))
+
+#define BITPACK_SYMBOLS		16
+#define BITPACK_SLACK		8
+#define BITPACK_HEADER_SIZE(symbols)	(1 + 1 + 1 + 1 + (symbols) + 4)
+
+#define ANS_MIN_LOG		6
+#define ANS_MAX_LOG		11
+#define ANS_ENTRIES		(1 << ANS_MAX_LOG)
+#define ANS_MIN			(1 << 12)
+#define ANS_SAVING		4
+#define ANS_HEADER_SIZE(symbols)	(1 + 1 + 1 + 1 + 3 * (symbols) + 4)
+
+#define FILTER_DELTA		1
+#define FILTER_SHUFFLE		2
+#define FILTER_MIN		(1 << 12)
+#define FILTER_MAX		(1 << 18)
+#define FILTER_SAMPLE		256
+#define FILTER_SHIFT		2
+#define FILTER_SAVING		5
+#define FILTER_HEADER_SIZE	(1 + 1 + 1)
+
+#define RUNS_MIN		(1 << 10)
+#define RUNS_MAX		(1 << 16)
+#define RUNS_SHIFT		1
+#define RUN_WORD		254
+#define RUN_LONG		255
+#define RUNS_HEADER_SIZE	(1 + 1 + 1 + 4 + 4 + 4)
+
+#define BUFFER_HEADER_SIZE	(4 + 4)
+#define BUFFER_GROUP_SIZE	(1 << 18)
+
+#define CHECK_CRC		(1 << 0)
+#define CHECK_SCAN		(1 << 1)
+#define SCAN_PIECE		(1 << 15)
+
+#define DECODE_COUNT_SHIFT	24
+#define DECODE_COUNT_MASK	3
+#define DECODE_LENGTH_SHIFT	26
+#define DECODE_ENTRY(symbols, count, length) \
+	((symbols) | (count) << DECODE_COUNT_SHIFT | \
+	    (length) << DECODE_LENGTH_SHIFT)
+
+#define TABLE_CACHE		4
+#define TABLE_KEY_SIZE		(MAX_CODE_LEN + SYMBOLS)
+
+#define PAIR_MAX_LENGTH		12
+#define PAIR_SHIFT		3
+
 struct encode_buf {
 	unsigned long buf_val;
 	unsigned int  buf_bits;
@@ -25,7 +127,10 @@ struct decode_buf {
 };
 
 struct counts {
-	unsigned int c[4][SYMBOLS];
+	union {
+		unsigned int   c[COUNT_LANES][SYMBOLS];
+		unsigned short s[COUNT_LANES][SYMBOLS];
+	};
 };
 
 struct symbol {
@@ -33,10 +138,67 @@ struct symbol {
 	unsigned int symbol;
 };
 
+struct encode {
+	unsigned int code;
+	unsigned int length;
+};
+
+struct ans_buf {
+	unsigned long buf_val;
+	unsigned int  buf_bits;
+	unsigned long buf_pos;
+	const unsigned char *buf_data;
+};
+
+/*
+ * A primary table entry: up to three symbols in bytes 0 to 2, the
+ * number of them at DECODE_COUNT_SHIFT and the bits they take at
+ * DECODE_LENGTH_SHIFT.  A count of zero marks a long code, the low 16
+ * bits then index its secondary table.  The vector decoders gather
+ * entries as 32 bit words, so the layout is packed by hand.
+ */
 struct decode {
-	unsigned char symbol[3];
-	unsigned int  count:2;
-	unsigned int  length:6;
+	unsigned int  value;
+};
+
+struct decode_cache {
+	unsigned int  hash;
+	unsigned int  size;
+	unsigned int  length;
+	unsigned int  used;
+	unsigned char key[TABLE_KEY_SIZE];
+};
+
+struct decode_context {
+	unsigned char symbol;
+	unsigned char length;
+};
+
+struct decode_ans {
+	unsigned short base;
+	unsigned char symbol;
+	unsigned char length;
+};
+
+struct encode_ans {
+	unsigned int  delta_length;
+	int           delta_state;
+};
+
+struct encode_context {
+	unsigned int  contexts[SYMBOLS][SYMBOLS];
+	unsigned char context_symbols[SYMBOLS * SYMBOLS];
+	struct encode context_codes[CONTEXT_CLASSES * SYMBOLS];
+	unsigned int  class_counts[CONTEXT_CLASSES][SYMBOLS];
+};
+
+/*
+ * The pair table and the context model are never used at once so share
+ * their scratch.
+ */
+union encode_scratch {
+	struct encode pairs[SYMBOLS * SYMBOLS];
+	struct encode_context context;
 };
 
 struct hmz_encode_state {
@@ -46,6 +208,23 @@ struct hmz_encode_state {
 	struct symbol *nodes;
 	unsigned int  lengths[SYMBOLS];
 	unsigned long codes[SYMBOLS];
+	struct encode *pairs;
+	struct encode_context *context;
+	unsigned short context_base[SYMBOLS];
+	unsigned char context_map[SYMBOLS];
+	struct encode_ans ans_symbols[SYMBOLS];
+	unsigned short ans_states[ANS_ENTRIES];
+	unsigned short ans_counts[SYMBOLS];
+	unsigned int  pairs_valid;
+	unsigned int  pair_mode;
+	unsigned int  depths[SYMBOLS];
+	unsigned int  inner_counts[16];
+	unsigned int  split_counts[SPLIT_BLOCKS][SYMBOLS];
+	unsigned char *filtered;
+	unsigned char *runs;
+	unsigned int  filter_size;
+	unsigned int  runs_size;
+	unsigned int  runs_nested;
 	unsigned int  code_counts[16];
 	unsigned int  symbol_count;
 	unsigned int  max_count;
@@ -53,19 +232,52 @@ struct hmz_encode_state {
 	unsigned int  max_length;
 	unsigned int  overflow;
 	unsigned int  format;
+	unsigned int  chunk_format;
+	unsigned int  flags;
+	unsigned int  width;
+	unsigned int  reuse;
+	unsigned int  reuse_header;
+	unsigned char ages[SYMBOLS];
+	unsigned int  cpu;
+	unsigned int  owned;
 	const unsigned char *in;
 	unsigned char *out;
 };
 
 struct hmz_decode_state {
 	struct symbol symbols[SYMBOLS];
-	struct decode table[TABLE_SIZE];
+	struct decode first_table[TABLE_SIZE];
+	struct decode *tables[TABLE_CACHE];
+	struct decode_cache cache[TABLE_CACHE];
+	struct decode *table;
+	unsigned int  cache_size;
+	union {
+		struct decode_context context_table[CONTEXT_ENTRIES];
+		struct decode_ans ans_table[ANS_ENTRIES];
+	};
+	unsigned short context_base[SYMBOLS];
+	unsigned long bitpack_table[SYMBOLS];
+	unsigned char *filtered;
+	unsigned char *runs;
+	unsigned int  filter_size;
+	unsigned int  runs_size;
 	unsigned int  lengths[SYMBOLS];
 	unsigned int  code_counts[16];
 	unsigned int  next_index[16];
 	unsigned int  symbol_count;
 	unsigned int  max_length;
 	unsigned int  format;
+	unsigned int  table_valid;
+	unsigned int  cache_clock;
+	unsigned int  check;
+	unsigned int  crc;
+	unsigned int  range;
+	unsigned int  offset;
+	unsigned int  cpu;
+	unsigned int  owned;
+	unsigned int  (*scan)(void *, const unsigned char *, unsigned int);
+	void          *scan_arg;
 	const unsigned char *in;
 	unsigned char *out;
+	unsigned char *checked;
 };
@@ -0,0 +1,570 @@
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmz_int.h"
+#include "hmz.h"
+
+/*
+ * A buffer is written in the same container as the hmz tool uses: the
+ * header value, the chunk size, then for each chunk its compressed size
+ * and data.  Under HEADER_CRC_VALUE each size is followed by the CRC32C
+ * of the chunk's original bytes, which is checked on decode.  Chunks are
+ * encoded in groups of about BUFFER_GROUP_SIZE
+ * bytes, each group starting from a reset state, so no group refers to a
+ * table in the group before it and the output does not depend on which
+ * thread encodes which group.
+ */
+
+struct buffer_job;
+
+struct buffer_worker {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	struct buffer_job *job;
+	unsigned long next;
+	unsigned long end;
+	unsigned int started;
+	unsigned int error;
+};
+
+struct buffer_job {
+	const unsigned char *in;
+	unsigned char *out;
+	unsigned long size_in;
+	unsigned long size_out;
+	unsigned long chunks;
+	unsigned long groups;
+	unsigned long *offsets;
+	unsigned long last;
+	struct buffer_worker *workers;
+	unsigned int chunk_size;
+	unsigned int group_chunks;
+	unsigned int format;
+	unsigned int checksum;
+	unsigned int threads;
+	unsigned int failed;
+};
+
+static inline unsigned int
+group_chunks(const unsigned int chunk_size)
+{
+	if (chunk_size >= BUFFER_GROUP_SIZE)
+		return 1;
+	return BUFFER_GROUP_SIZE / chunk_size;
+}
+
+/*
+ * Take the next group from the worker's own range, or once that is empty
+ * steal the back half of another worker's range.
+ */
+static inline unsigned int
+take_group(struct buffer_job * const job, struct buffer_worker * const self,
+    unsigned long * const group)
+{
+	struct buffer_worker *victim;
+	unsigned long next;
+	unsigned long end;
+	unsigned int i;
+
+	if (__atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&self->lock);
+	if (self->next < self->end) {
+		*group = self->next++;
+		pthread_mutex_unlock(&self->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	for (i = 1; i < job->threads; i++) {
+		victim = &job->workers[(self - job->workers + i) % job->threads];
+
+		pthread_mutex_lock(&victim->lock);
+		next = victim->next;
+		end = victim->end;
+		if (next < end) {
+			next += (end - next) >> 1;
+			victim->end = next;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (next == end)
+			continue;
+
+		pthread_mutex_lock(&self->lock);
+		self->next = next + 1;
+		self->end = end;
+		pthread_mutex_unlock(&self->lock);
+
+		*group = next;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run the workers over the groups, the calling thread being the first.
+ * A worker whose thread cannot be created just has its range stolen.
+ */
+static inline unsigned int
+run_workers(struct buffer_job * const job, void *(*routine)(void *))
+{
+	struct buffer_worker *workers;
+	unsigned int error = 0;
+	unsigned int i;
+
+	if (job->threads > job->groups)
+		job->threads = job->groups;
+	if (job->threads == 0)
+		return 0;
+
+	workers = calloc(job->threads, sizeof(*workers));
+	if (workers == NULL)
+		return ENOMEM;
+
+	job->workers = workers;
+	for (i = 0; i < job->threads; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		workers[i].job = job;
+		workers[i].next = job->groups * i / job->threads;
+		workers[i].end = job->groups * (i + 1) / job->threads;
+	}
+
+	for (i = 1; i < job->threads; i++)
+		workers[i].started = pthread_create(&workers[i].thread, NULL,
+		    routine, &workers[i]) == 0;
+
+	routine(&workers[0]);
+
+	for (i = 0; i < job->threads; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		if (error == 0)
+			error = workers[i].error;
+		pthread_mutex_destroy(&workers[i].lock);
+	}
+
+	free(workers);
+	job->workers = NULL;
+
+	return error;
+}
+
+/*
+ * The worst case size of a buffer encoded with hmz_encode_buffer(), every
+ * chunk stored.  Zero if the chunk size is invalid.
+ */
+unsigned long
+hmz_buffer_bound(const unsigned long size, const unsigned int chunk_size)
+{
+	if (chunk_size == 0 || chunk_size > HMZ_MAX_CHUNK ||
+	    size > (~0UL >> 2))
+		return 0;
+
+	return BUFFER_HEADER_SIZE + (size + chunk_size - 1) / chunk_size * 4 +
+	    size;
+}
+
+/*
+ * Each group is encoded at its worst case offset in the output, the groups
+ * are moved together once all are done.
+ */
+static inline unsigned int
+encode_group(struct buffer_job * const job,
+    struct hmz_encode_state * const state, const unsigned long group)
+{
+	const unsigned long first = group * job->group_chunks;
+	unsigned char * const start = job->out + BUFFER_HEADER_SIZE +
+	    first * (4 + (unsigned long)job->chunk_size);
+	unsigned char *out = start;
+	const unsigned char *in;
+	unsigned long last;
+	unsigned long c;
+	unsigned int size_in;
+	unsigned int size_out;
+	unsigned int size_flag;
+	unsigned int error;
+
+	last = first + job->group_chunks;
+	if (last > job->chunks)
+		last = job->chunks;
+
+	hmz_encode_reset(state);
+
+	for (c = first; c < last; c++) {
+		in = job->in + c * job->chunk_size;
+		size_in = job->chunk_size;
+		if (job->size_in - c * job->chunk_size < size_in)
+			size_in = job->size_in - c * job->chunk_size;
+
+		size_out = size_in;
+		size_flag = 0;
+		error = EOVERFLOW;
+		if (size_out >= MIN_HEADER_SIZE)
+			error = hmz_encode(state, in, size_in, out + 4,
+			    &size_out);
+		if (error == EOVERFLOW) {
+			memcpy(out + 4, in, size_in);
+			size_out = size_in;
+			size_flag = HMZ_NO_COMPRESSION;
+			error = 0;
+		}
+
+		if (error != 0)
+			return error;
+
+		size_flag |= size_out;
+		memcpy(out, &size_flag, 4);
+		out += 4 + size_out;
+	}
+
+	job->offsets[group] = out - start;
+	return 0;
+}
+
+static void *
+encode_worker(void * const arg)
+{
+	struct buffer_worker * const worker = arg;
+	struct buffer_job * const job = worker->job;
+	struct hmz_encode_state *state;
+	unsigned long group;
+
+	worker->error = hmz_encode_init(&state, job->format,
+	    job->chunk_size);
+	if (worker->error != 0)
+		goto out;
+
+	while (take_group(job, worker, &group)) {
+		worker->error = encode_group(job, state, group);
+		if (worker->error != 0)
+			break;
+	}
+
+	hmz_encode_finish(state);
+
+ out:
+	if (worker->error != 0)
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Encode a buffer of any size on up to threads threads.  The output is the
+ * same whatever the thread count, size_out must be at least
+ * hmz_buffer_bound() bytes.
+ */
+unsigned int
+hmz_encode_buffer(const unsigned char * const buffer_in,
+    const unsigned long size_in, unsigned char * const buffer_out,
+    unsigned long * const size_out, const unsigned int chunk_size,
+    const unsigned int format, const unsigned int threads)
+{
+	struct buffer_job job;
+	unsigned char *out;
+	unsigned long bound;
+	unsigned long g;
+	unsigned int header;
+	unsigned int error;
+
+	bound = hmz_buffer_bound(size_in, chunk_size);
+	if ((buffer_in == NULL && size_in != 0) || buffer_out == NULL ||
+	    size_out == NULL || bound == 0 || threads == 0)
+		return EINVAL;
+
+	if (*size_out < bound)
+		return EOVERFLOW;
+
+	memset(&job, 0, sizeof(job));
+	job.in = buffer_in;
+	job.out = buffer_out;
+	job.size_in = size_in;
+	job.chunk_size = chunk_size;
+	job.group_chunks = group_chunks(chunk_size);
+	job.chunks = (size_in + chunk_size - 1) / chunk_size;
+	job.groups = (job.chunks + job.group_chunks - 1) / job.group_chunks;
+	job.format = format;
+	job.threads = threads;
+
+	job.offsets = malloc((job.groups + 1) * sizeof(*job.offsets));
+	if (job.offsets == NULL)
+		return ENOMEM;
+
+	error = run_workers(&job, encode_worker);
+	if (error != 0)
+		goto out;
+
+	header = HEADER_VALUE;
+	memcpy(buffer_out, &header, 4);
+	memcpy(buffer_out + 4, &chunk_size, 4);
+
+	out = buffer_out + BUFFER_HEADER_SIZE;
+	for (g = 0; g < job.groups; g++) {
+		memmove(out, buffer_out + BUFFER_HEADER_SIZE +
+		    g * job.group_chunks * (4 + (unsigned long)chunk_size),
+		    job.offsets[g]);
+		out += job.offsets[g];
+	}
+
+	*size_out = out - buffer_out;
+
+ out:
+	free(job.offsets);
+	return error;
+}
+
+/*
+ * Walk the chunk sizes, checking they fit the buffer, and note where each
+ * group starts if offsets is set.
+ */
+static inline unsigned int
+scan_chunks(struct buffer_job * const job, unsigned long * const offsets)
+{
+	const unsigned int frame = job->checksum ? 4 + 4 : 4;
+	unsigned long pos = BUFFER_HEADER_SIZE;
+	unsigned long c = 0;
+	unsigned int size;
+
+	while (pos < job->size_in) {
+		if (job->size_in - pos < frame)
+			return EIO;
+
+		memcpy(&size, job->in + pos, 4);
+		size &= ~HMZ_NO_COMPRESSION;
+		if (size > job->chunk_size || job->size_in - pos - frame < size)
+			return EIO;
+
+		if (offsets != NULL && c % job->group_chunks == 0)
+			offsets[c / job->group_chunks] = pos;
+
+		pos += frame + size;
+		c++;
+	}
+
+	job->chunks = c;
+	job->groups = (c + job->group_chunks - 1) / job->group_chunks;
+
+	return 0;
+}
+
+static inline unsigned int
+decode_one(const struct buffer_job * const job,
+    struct hmz_decode_state * const state, const unsigned char * const in,
+    const unsigned int size_in, unsigned char * const out,
+    unsigned int * const size_out, unsigned int * const crc)
+{
+	if (job->checksum)
+		return hmz_decode_crc(state, in, size_in, out, size_out, crc);
+	return hmz_decode(state, in, size_in, out, size_out);
+}
+
+/*
+ * How a chunk fails to fit depends on its encoding, so a chunk with less
+ * than a chunk of room is decoded to a scratch chunk first and a short
+ * output buffer is always EOVERFLOW.
+ */
+static inline unsigned int
+decode_short(const struct buffer_job * const job,
+    struct hmz_decode_state * const state, const unsigned char * const in,
+    const unsigned int size_in, unsigned char * const out,
+    unsigned int * const size_out, unsigned int * const crc)
+{
+	unsigned char *scratch;
+	unsigned int size;
+	unsigned int error;
+
+	scratch = malloc(job->chunk_size);
+	if (scratch == NULL)
+		return ENOMEM;
+
+	size = job->chunk_size;
+	error = decode_one(job, state, in, size_in, scratch, &size, crc);
+	if (error == 0 && size > *size_out)
+		error = EOVERFLOW;
+	if (error == 0) {
+		memcpy(out, scratch, size);
+		*size_out = size;
+	}
+
+	free(scratch);
+	return error;
+}
+
+/*
+ * Chunk c decodes to c * chunk_size, every chunk but the last must fill
+ * the chunk size.
+ */
+static inline unsigned int
+decode_group(struct buffer_job * const job,
+    struct hmz_decode_state * const state, const unsigned long group)
+{
+	const unsigned long first = group * job->group_chunks;
+	const unsigned char *in = job->in + job->offsets[group];
+	unsigned char *out;
+	unsigned long last;
+	unsigned long c;
+	unsigned int size_in;
+	unsigned int size_out;
+	unsigned int no_compression;
+	unsigned int crc_in = 0;
+	unsigned int crc = 0;
+	unsigned int error;
+
+	last = first + job->group_chunks;
+	if (last > job->chunks)
+		last = job->chunks;
+
+	hmz_decode_reset(state);
+
+	for (c = first; c < last; c++) {
+		memcpy(&size_in, in, 4);
+		in += 4;
+
+		no_compression = (size_in & HMZ_NO_COMPRESSION) != 0;
+		size_in &= ~HMZ_NO_COMPRESSION;
+
+		if (job->checksum) {
+			memcpy(&crc_in, in, 4);
+			in += 4;
+		}
+
+		out = job->out + c * job->chunk_size;
+		size_out = job->chunk_size;
+		if (job->size_out - c * job->chunk_size < size_out)
+			size_out = job->size_out - c * job->chunk_size;
+
+		if (no_compression) {
+			if (size_in > size_out)
+				return EOVERFLOW;
+			memcpy(out, in, size_in);
+			size_out = size_in;
+			if (job->checksum)
+				crc = hmz_crc32c(0, out, size_out);
+		} else if (size_out < job->chunk_size) {
+			error = decode_short(job, state, in, size_in, out,
+			    &size_out, &crc);
+			if (error != 0)
+				return error;
+		} else {
+			error = decode_one(job, state, in, size_in, out,
+			    &size_out, &crc);
+			if (error != 0)
+				return error;
+		}
+
+		if (crc != crc_in)
+			return EIO;
+
+		if (c + 1 < job->chunks && size_out != job->chunk_size)
+			return EIO;
+
+		in += size_in;
+	}
+
+	if (last == job->chunks)
+		job->last = size_out;
+
+	return 0;
+}
+
+static void *
+decode_worker(void * const arg)
+{
+	struct buffer_worker * const worker = arg;
+	struct buffer_job * const job = worker->job;
+	struct hmz_decode_state *state;
+	unsigned long group;
+
+	worker->error = hmz_decode_init(&state, job->chunk_size);
+	if (worker->error != 0)
+		goto out;
+
+	while (take_group(job, worker, &group)) {
+		worker->error = decode_group(job, state, group);
+		if (worker->error != 0)
+			break;
+	}
+
+	hmz_decode_finish(state);
+
+ out:
+	if (worker->error != 0)
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * Decode a buffer written by hmz_encode_buffer() on up to threads threads.
+ * size_out is the size of the output buffer on entry and the decoded size
+ * on return.
+ */
+unsigned int
+hmz_decode_buffer(const unsigned char * const buffer_in,
+    const unsigned long size_in, unsigned char * const buffer_out,
+    unsigned long * const size_out, const unsigned int threads)
+{
+	struct buffer_job job;
+	unsigned int header;
+	unsigned int chunk_size;
+	unsigned int error;
+
+	if (buffer_in == NULL || size_out == NULL ||
+	    (buffer_out == NULL && *size_out != 0) || threads == 0)
+		return EINVAL;
+
+	if (size_in < BUFFER_HEADER_SIZE)
+		return EIO;
+
+	memcpy(&header, buffer_in, 4);
+	memcpy(&chunk_size, buffer_in + 4, 4);
+	if ((header != HEADER_VALUE && header != HEADER_CRC_VALUE) ||
+	    chunk_size == 0 ||
+	    chunk_size > HMZ_MAX_CHUNK)
+		return EINVAL;
+
+	memset(&job, 0, sizeof(job));
+	job.in = buffer_in;
+	job.out = buffer_out;
+	job.size_in = size_in;
+	job.size_out = *size_out;
+	job.chunk_size = chunk_size;
+	job.group_chunks = group_chunks(chunk_size);
+	job.checksum = (header == HEADER_CRC_VALUE);
+	job.threads = threads;
+
+	error = scan_chunks(&job, NULL);
+	if (error != 0)
+		return error;
+
+	if (job.chunks == 0) {
+		*size_out = 0;
+		return 0;
+	}
+
+	if (job.size_out == 0 ||
+	    (job.size_out - 1) / chunk_size < job.chunks - 1)
+		return EOVERFLOW;
+
+	job.offsets = malloc(job.groups * sizeof(*job.offsets));
+	if (job.offsets == NULL)
+		return ENOMEM;
+
+	error = scan_chunks(&job, job.offsets);
+	if (error != 0)
+		goto out;
+
+	error = run_workers(&job, decode_worker);
+	if (error != 0)
+		goto out;
+
+	*size_out = (job.chunks - 1) * chunk_size + job.last;
+
+ out:
+	free(job.offsets);
+	return error;
+}
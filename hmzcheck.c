@@ -0,0 +1,493 @@
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hmz.h"
+
+/*
+ * Checks of the library calls the hmz tool does not make, run by
+ * make check over synthetic data of each kind the encoder treats
+ * differently.
+ */
+
+#define CHECK_SIZE	((1 << 20) + 4099)
+#define CHECK_THREADS	4
+
+struct check_data {
+	const char *name;
+	void (*fill)(unsigned char *, unsigned int, unsigned long *);
+};
+
+static const unsigned int check_formats[] = {
+	HMZ_FMT_SINGLE,
+	HMZ_FMT_MULTI,
+	HMZ_FMT_MULTI8,
+	HMZ_FMT_MULTI16,
+	HMZ_FMT_MULTI | HMZ_FLAG_REUSE,
+	HMZ_FMT_MULTI | HMZ_FLAG_OPTIMAL,
+	HMZ_FMT_MULTI | HMZ_FLAG_CONTEXT,
+	HMZ_FMT_MULTI | HMZ_WIDTH(4),
+};
+
+static const unsigned int check_chunks[] = {
+	HMZ_DEF_CHUNK,
+	5000,
+	1 << 17,
+};
+
+static unsigned int failures;
+
+static inline unsigned long
+next_random(unsigned long * const seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static void
+fill_random(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	while (size--)
+		*buf++ = next_random(seed);
+}
+
+static void
+fill_skew(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	while (size--)
+		*buf++ = __builtin_ctzl(next_random(seed) | (1UL << 40)) * 5;
+}
+
+static void
+fill_text(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	static const char * const words[] = {
+		"the ", "of ", "and ", "a ", "to ", "in ", "is ", "chunk ",
+		"stream ", "table ", "code ", "length ", "symbol ", ", ",
+		". ", "\n",
+	};
+	const char *word;
+	unsigned int len;
+
+	while (size > 0) {
+		word = words[next_random(seed) & 15];
+		len = strlen(word);
+		if (len > size)
+			len = size;
+		memcpy(buf, word, len);
+		buf += len;
+		size -= len;
+	}
+}
+
+static void
+fill_runs(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	unsigned long r;
+	unsigned int len;
+
+	while (size > 0) {
+		r = next_random(seed);
+		len = (r & 1) ? r % 300 + 1 : 1;
+		if (len > size)
+			len = size;
+		memset(buf, (r & 1) ? 0 : (r >> 16) & 7, len);
+		buf += len;
+		size -= len;
+	}
+}
+
+static void
+fill_ints(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	unsigned int value = 1000000;
+
+	while (size >= 4) {
+		value += next_random(seed) % 64;
+		memcpy(buf, &value, 4);
+		buf += 4;
+		size -= 4;
+	}
+	memset(buf, 0, size);
+}
+
+static void
+fill_zero(unsigned char *buf, unsigned int size, unsigned long *seed)
+{
+	(void)seed;
+	memset(buf, 0, size);
+}
+
+static const struct check_data check_data[] = {
+	{ "random", fill_random },
+	{ "skew", fill_skew },
+	{ "text", fill_text },
+	{ "runs", fill_runs },
+	{ "ints", fill_ints },
+	{ "zero", fill_zero },
+};
+
+#define NELEMS(a)	(sizeof(a) / sizeof((a)[0]))
+
+static void
+fail(const char * const check, const char * const data,
+    const unsigned int format, const unsigned int chunk,
+    const char * const what, const unsigned int error)
+{
+	printf("%s: %s format 0x%x chunk %u: %s (%u)\n", check, data, format,
+	    chunk, what, error);
+	failures++;
+}
+
+/*
+ * hmz_encode_buffer() must give the same bytes whatever the thread count,
+ * hmz_decode_buffer() must give back the input on any thread count and
+ * fail with EOVERFLOW alone when the output is a byte short.
+ */
+static void
+check_buffer(const char * const name, const unsigned char * const data,
+    const unsigned int size, const unsigned int format,
+    const unsigned int chunk, unsigned char * const out1,
+    unsigned char * const out2, unsigned char * const back)
+{
+	const unsigned long bound = hmz_buffer_bound(size, chunk);
+	unsigned long size1 = bound;
+	unsigned long size2 = bound;
+	unsigned long size_back;
+	unsigned int error;
+
+	error = hmz_encode_buffer(data, size, out1, &size1, chunk, format, 1);
+	if (error != 0) {
+		fail("buffer", name, format, chunk, "encode", error);
+		return;
+	}
+
+	error = hmz_encode_buffer(data, size, out2, &size2, chunk, format,
+	    CHECK_THREADS);
+	if (error != 0) {
+		fail("buffer", name, format, chunk, "threaded encode", error);
+		return;
+	}
+
+	if (size1 != size2 || memcmp(out1, out2, size1) != 0)
+		fail("buffer", name, format, chunk, "threads differ", 0);
+
+	size_back = size;
+	error = hmz_decode_buffer(out1, size1, back, &size_back,
+	    CHECK_THREADS);
+	if (error != 0 || size_back != size || memcmp(back, data, size) != 0)
+		fail("buffer", name, format, chunk, "decode", error);
+
+	size_back = size - 1;
+	error = hmz_decode_buffer(out1, size1, back, &size_back, 1);
+	if (error != EOVERFLOW)
+		fail("buffer", name, format, chunk, "short output", error);
+}
+
+/*
+ * A state in caller memory sized for chunk size zero skips the features
+ * that need scratch, what it encodes must still decode, and decoding
+ * chunks that need scratch it lacks must fail with ENOMEM.
+ */
+static void
+check_state(const char * const name, const unsigned char * const data,
+    const unsigned int size, const unsigned int format,
+    const unsigned int chunk, unsigned char * const out,
+    unsigned char * const back)
+{
+	struct hmz_encode_state *small_enc = NULL;
+	struct hmz_encode_state *enc = NULL;
+	struct hmz_decode_state *small_dec = NULL;
+	struct hmz_decode_state *dec = NULL;
+	void *enc_mem;
+	void *dec_mem;
+	unsigned int size_in;
+	unsigned int size_out;
+	unsigned int size_back;
+	unsigned int pos;
+	unsigned int error;
+
+	enc_mem = aligned_alloc(HMZ_STATE_ALIGN,
+	    hmz_encode_state_size(format, 0));
+	dec_mem = aligned_alloc(HMZ_STATE_ALIGN, hmz_decode_state_size(0));
+	if (enc_mem == NULL || dec_mem == NULL ||
+	    hmz_encode_init_mem(&small_enc, enc_mem,
+	    hmz_encode_state_size(format, 0), format, 0) != 0 ||
+	    hmz_decode_init_mem(&small_dec, dec_mem,
+	    hmz_decode_state_size(0), 0) != 0 ||
+	    hmz_encode_init(&enc, format, chunk) != 0 ||
+	    hmz_decode_init(&dec, chunk) != 0) {
+		fail("state", name, format, chunk, "init", 0);
+		goto out;
+	}
+
+	for (pos = 0; pos < size; pos += size_in) {
+		size_in = (size - pos < chunk) ? size - pos : chunk;
+
+		size_out = hmz_compressed_size(size_in);
+		error = hmz_encode(small_enc, data + pos, size_in, out,
+		    &size_out);
+		size_back = chunk;
+		if (error == 0)
+			error = hmz_decode(dec, out, size_out, back,
+			    &size_back);
+		if (error != 0 || size_back != size_in ||
+		    memcmp(back, data + pos, size_in) != 0) {
+			fail("state", name, format, chunk, "small encoder",
+			    error);
+			break;
+		}
+
+		size_out = hmz_compressed_size(size_in);
+		error = hmz_encode(enc, data + pos, size_in, out, &size_out);
+		size_back = chunk;
+		if (error == 0)
+			error = hmz_decode(small_dec, out, size_out, back,
+			    &size_back);
+		if (error != ENOMEM && (error != 0 || size_back != size_in ||
+		    memcmp(back, data + pos, size_in) != 0)) {
+			fail("state", name, format, chunk, "small decoder",
+			    error);
+			break;
+		}
+	}
+
+ out:
+	hmz_encode_finish(enc);
+	hmz_decode_finish(dec);
+	free(enc_mem);
+	free(dec_mem);
+}
+
+/*
+ * hmz_encode_estimate() must give the size hmz_encode() then writes for
+ * every chunk but context coded ones, and must not change what it
+ * writes, sampled or not.
+ */
+static void
+check_estimate(const char * const name, const unsigned char * const data,
+    const unsigned int size, const unsigned int format,
+    const unsigned int chunk, unsigned char * const out1,
+    unsigned char * const out2)
+{
+	struct hmz_encode_state *plain = NULL;
+	struct hmz_encode_state *enc = NULL;
+	unsigned int size_in;
+	unsigned int size1;
+	unsigned int size2;
+	unsigned int estimate;
+	unsigned int sampled;
+	unsigned int tag;
+	unsigned int pos;
+	unsigned int error;
+
+	if (hmz_encode_init(&plain, format, chunk) != 0 ||
+	    hmz_encode_init(&enc, format, chunk) != 0) {
+		fail("estimate", name, format, chunk, "init", 0);
+		goto out;
+	}
+
+	for (pos = 0; pos < size; pos += size_in) {
+		size_in = (size - pos < chunk) ? size - pos : chunk;
+
+		error = hmz_encode_estimate(enc, data + pos, size_in,
+		    &sampled, &tag, HMZ_ESTIMATE_SAMPLE);
+		if (error == 0)
+			error = hmz_encode_estimate(enc, data + pos, size_in,
+			    &estimate, &tag, 0);
+		if (error != 0 || sampled > hmz_compressed_size(size_in)) {
+			fail("estimate", name, format, chunk, "estimate",
+			    error);
+			break;
+		}
+
+		size1 = hmz_compressed_size(size_in);
+		size2 = size1;
+		error = hmz_encode(enc, data + pos, size_in, out1, &size1);
+		if (error == 0)
+			error = hmz_encode(plain, data + pos, size_in, out2,
+			    &size2);
+		if (error != 0) {
+			fail("estimate", name, format, chunk, "encode", error);
+			break;
+		}
+
+		if (size1 != size2 || memcmp(out1, out2, size1) != 0) {
+			fail("estimate", name, format, chunk, "side effect", 0);
+			break;
+		}
+
+		if (!(format & HMZ_FLAG_CONTEXT) && estimate != size1) {
+			fail("estimate", name, format, chunk, "size differs",
+			    estimate);
+			break;
+		}
+	}
+
+ out:
+	hmz_encode_finish(plain);
+	hmz_encode_finish(enc);
+}
+
+/*
+ * hmz_decode_range() must give the same bytes as the slice of a whole
+ * decode, for ranges at either end and across stream and part bounds,
+ * or ENOTSUP for the chunks it leaves to hmz_decode().
+ */
+static void
+check_range(const char * const name, const unsigned char * const data,
+    const unsigned int size, const unsigned int format,
+    const unsigned int chunk, unsigned char * const out,
+    unsigned char * const back)
+{
+	struct hmz_encode_state *enc = NULL;
+	struct hmz_decode_state *dec = NULL;
+	struct hmz_decode_state *range = NULL;
+	unsigned char *slice = back + chunk;
+	unsigned int offsets[5];
+	unsigned int lengths[3];
+	unsigned int size_in;
+	unsigned int size_out;
+	unsigned int size_back;
+	unsigned int size_range;
+	unsigned int expect;
+	unsigned int pos;
+	unsigned int error;
+	unsigned int i;
+	unsigned int j;
+
+	if (hmz_encode_init(&enc, format, chunk) != 0 ||
+	    hmz_decode_init(&dec, chunk) != 0 ||
+	    hmz_decode_init(&range, chunk) != 0) {
+		fail("range", name, format, chunk, "init", 0);
+		goto out;
+	}
+
+	for (pos = 0; pos < size; pos += size_in) {
+		size_in = (size - pos < chunk) ? size - pos : chunk;
+
+		size_out = hmz_compressed_size(size_in);
+		error = hmz_encode(enc, data + pos, size_in, out, &size_out);
+		size_back = chunk;
+		if (error == 0)
+			error = hmz_decode(dec, out, size_out, back,
+			    &size_back);
+		if (error != 0 || size_back != size_in) {
+			fail("range", name, format, chunk, "decode", error);
+			break;
+		}
+
+		offsets[0] = 0;
+		offsets[1] = size_in / 3;
+		offsets[2] = size_in / 2 + 1;
+		offsets[3] = (size_in > 17) ? size_in - 17 : 0;
+		offsets[4] = size_in - 1;
+		lengths[0] = 1;
+		lengths[1] = 300;
+		lengths[2] = size_in;
+
+		for (i = 0; i < NELEMS(offsets); i++)
+			for (j = 0; j < NELEMS(lengths); j++) {
+				size_range = lengths[j];
+				error = hmz_decode_range(range, out, size_out,
+				    offsets[i], slice, &size_range);
+				if (error == ENOTSUP)
+					goto whole;
+				expect = size_in - offsets[i];
+				if (expect > lengths[j])
+					expect = lengths[j];
+				if (error != 0 || size_range != expect ||
+				    memcmp(slice, back + offsets[i],
+				    expect) != 0) {
+					fail("range", name, format, chunk,
+					    "range differs", error);
+					goto out;
+				}
+			}
+		continue;
+
+		/*
+		 * A chunk range decoding leaves to hmz_decode() is decoded
+		 * whole so a chunk reusing its table can follow.
+		 */
+ whole:
+		size_back = chunk;
+		error = hmz_decode(range, out, size_out, slice, &size_back);
+		if (error != 0) {
+			fail("range", name, format, chunk, "whole", error);
+			break;
+		}
+	}
+
+ out:
+	hmz_encode_finish(enc);
+	hmz_decode_finish(dec);
+	hmz_decode_finish(range);
+}
+
+int
+main(void)
+{
+	unsigned char *data;
+	unsigned char *out1;
+	unsigned char *out2;
+	unsigned char *back;
+	unsigned long bound;
+	unsigned long seed = 88172645463325252UL;
+	unsigned int d;
+	unsigned int f;
+	unsigned int c;
+
+	bound = hmz_buffer_bound(CHECK_SIZE, 1);
+	data = malloc(CHECK_SIZE);
+	out1 = malloc(bound);
+	out2 = malloc(bound);
+	back = malloc(CHECK_SIZE);
+	if (data == NULL || out1 == NULL || out2 == NULL || back == NULL) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	for (d = 0; d < NELEMS(check_data); d++) {
+		check_data[d].fill(data, CHECK_SIZE, &seed);
+
+		for (f = 0; f < NELEMS(check_formats); f++)
+			for (c = 0; c < NELEMS(check_chunks); c++)
+				check_buffer(check_data[d].name, data,
+				    CHECK_SIZE, check_formats[f],
+				    check_chunks[c], out1, out2, back);
+
+		for (f = 0; f < NELEMS(check_formats); f++)
+			for (c = 0; c < NELEMS(check_chunks); c++)
+				check_estimate(check_data[d].name, data,
+				    CHECK_SIZE, check_formats[f],
+				    check_chunks[c], out1, out2);
+
+		for (f = 0; f < NELEMS(check_formats); f++)
+			for (c = 0; c < NELEMS(check_chunks); c++)
+				check_range(check_data[d].name, data,
+				    CHECK_SIZE, check_formats[f],
+				    check_chunks[c], out1, back);
+
+		for (f = 0; f < NELEMS(check_formats); f++)
+			check_state(check_data[d].name, data, CHECK_SIZE,
+			    check_formats[f], HMZ_DEF_CHUNK, out1, back);
+	}
+
+	free(data);
+	free(out1);
+	free(out2);
+	free(back);
+
+	if (failures != 0) {
+		printf("%u checks failed\n", failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
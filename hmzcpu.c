@@ -0,0 +1,43 @@
+#include "hmz.h"
+
+static unsigned int cpu_mask = ~0U;
+
+static inline unsigned int
+cpu_detect(void)
+{
+	unsigned int features = 0;
+
+	if (__builtin_cpu_supports("sse4.2"))
+		features |= HMZ_CPU_SSE42;
+	if (__builtin_cpu_supports("bmi2"))
+		features |= HMZ_CPU_BMI2;
+	if (__builtin_cpu_supports("avx2"))
+		features |= HMZ_CPU_AVX2;
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw"))
+		features |= HMZ_CPU_AVX512;
+
+	return features;
+}
+
+/*
+ * Return the cpu features the encode and decode kernels may use.  States
+ * sample this when they are initialised.
+ */
+unsigned int
+hmz_cpu_features(void)
+{
+	return cpu_detect() & cpu_mask;
+}
+
+/*
+ * Restrict the cpu features used by states initialised from now on, eg
+ * to benchmark the generic kernels on a cpu that supports more.
+ */
+unsigned int
+hmz_set_cpu_features(const unsigned int features)
+{
+	cpu_mask = features;
+
+	return hmz_cpu_features();
+}
@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hmz.h"
+
+#define CRC_POLY	0x82F63B78
+#define CRC_LONG	8192
+#define CRC_SHORT	256
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static unsigned int crc_table[8][256];
+static unsigned int crc_long[4][256];
+static unsigned int crc_short[4][256];
+
+static inline unsigned int
+gf2_times(const unsigned int * const mat, unsigned int vec)
+{
+	unsigned int sum = 0;
+	unsigned int i;
+
+	for (i = 0; vec != 0; i++, vec >>= 1) {
+		if (vec & 1)
+			sum ^= mat[i];
+	}
+
+	return sum;
+}
+
+static inline void
+gf2_square(unsigned int * const square, const unsigned int * const mat)
+{
+	unsigned int i;
+
+	for (i = 0; i < 32; i++)
+		square[i] = gf2_times(mat, mat[i]);
+}
+
+/*
+ * Operator that appends len zero bytes to a crc, len a power of two.
+ */
+static void
+crc_zeros_op(unsigned int * const even, unsigned int len)
+{
+	unsigned int odd[32];
+	unsigned int row = 1;
+	unsigned int i;
+
+	odd[0] = CRC_POLY;
+	for (i = 1; i < 32; i++) {
+		odd[i] = row;
+		row <<= 1;
+	}
+
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+
+	do {
+		gf2_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_square(odd, even);
+		len >>= 1;
+	} while (len != 0);
+
+	memcpy(even, odd, sizeof(odd));
+}
+
+static void
+crc_zeros(unsigned int zeros[][256], const unsigned int len)
+{
+	unsigned int op[32];
+	unsigned int i;
+
+	crc_zeros_op(op, len);
+	for (i = 0; i < 256; i++) {
+		zeros[0][i] = gf2_times(op, i);
+		zeros[1][i] = gf2_times(op, i << 8);
+		zeros[2][i] = gf2_times(op, i << 16);
+		zeros[3][i] = gf2_times(op, i << 24);
+	}
+}
+
+static void
+crc_init(void)
+{
+	unsigned int crc;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ CRC_POLY : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc_table[0][crc & 0xFF] ^ (crc >> 8);
+			crc_table[j][i] = crc;
+		}
+	}
+
+	crc_zeros(crc_long, CRC_LONG);
+	crc_zeros(crc_short, CRC_SHORT);
+}
+
+static inline unsigned int
+crc_shift(unsigned int zeros[][256], const unsigned int crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+	    zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/*
+ * Slice by 8, eight table lookups per word.
+ */
+static inline unsigned int
+crc_generic(unsigned int crc, const unsigned char *buffer, unsigned int size)
+{
+	unsigned long v;
+
+	for (; size >= 8; size -= 8, buffer += 8) {
+		memcpy(&v, buffer, 8);
+		v ^= crc;
+		crc = crc_table[7][v & 0xFF] ^
+		    crc_table[6][(v >> 8) & 0xFF] ^
+		    crc_table[5][(v >> 16) & 0xFF] ^
+		    crc_table[4][(v >> 24) & 0xFF] ^
+		    crc_table[3][(v >> 32) & 0xFF] ^
+		    crc_table[2][(v >> 40) & 0xFF] ^
+		    crc_table[1][(v >> 48) & 0xFF] ^
+		    crc_table[0][v >> 56];
+	}
+
+	for (; size > 0; size--)
+		crc = crc_table[0][(crc ^ *buffer++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but issues one per
+ * cycle, so three lanes of a block are summed at once and the first two
+ * shifted over the rest of the block with the zeros tables.
+ */
+__attribute__((target("sse4.2")))
+static inline unsigned long
+crc_lanes(unsigned long crc0, const unsigned char * const buffer,
+    const unsigned int lane, unsigned int zeros[][256])
+{
+	const unsigned char *curr = buffer;
+	const unsigned char * const end = buffer + lane;
+	unsigned long crc1 = 0;
+	unsigned long crc2 = 0;
+	unsigned long v0;
+	unsigned long v1;
+	unsigned long v2;
+
+	do {
+		memcpy(&v0, curr, 8);
+		memcpy(&v1, curr + lane, 8);
+		memcpy(&v2, curr + 2 * lane, 8);
+		crc0 = _mm_crc32_u64(crc0, v0);
+		crc1 = _mm_crc32_u64(crc1, v1);
+		crc2 = _mm_crc32_u64(crc2, v2);
+		curr += 8;
+	} while (curr < end);
+
+	crc0 = crc_shift(zeros, crc0) ^ crc1;
+	return crc_shift(zeros, crc0) ^ crc2;
+}
+
+__attribute__((target("sse4.2")))
+static inline unsigned int
+crc_sse42(unsigned int crc, const unsigned char *buffer, unsigned int size)
+{
+	unsigned long crc0 = crc;
+	unsigned long v;
+
+	for (; size >= 3 * CRC_LONG; size -= 3 * CRC_LONG) {
+		crc0 = crc_lanes(crc0, buffer, CRC_LONG, crc_long);
+		buffer += 3 * CRC_LONG;
+	}
+
+	for (; size >= 3 * CRC_SHORT; size -= 3 * CRC_SHORT) {
+		crc0 = crc_lanes(crc0, buffer, CRC_SHORT, crc_short);
+		buffer += 3 * CRC_SHORT;
+	}
+
+	for (; size >= 8; size -= 8, buffer += 8) {
+		memcpy(&v, buffer, 8);
+		crc0 = _mm_crc32_u64(crc0, v);
+	}
+
+	for (; size > 0; size--)
+		crc0 = _mm_crc32_u8(crc0, *buffer++);
+
+	return crc0;
+}
+
+/*
+ * CRC32C (Castagnoli) of a buffer, continuing from a previous result or
+ * 0 to start.
+ */
+unsigned int
+hmz_crc32c(const unsigned int crc, const unsigned char * const buffer,
+    const unsigned int size)
+{
+	pthread_once(&crc_once, crc_init);
+
+	if (hmz_cpu_features() & HMZ_CPU_SSE42)
+		return ~crc_sse42(~crc, buffer, size);
+	return ~crc_generic(~crc, buffer, size);
+}
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <immintrin.h>
 
 #include "hmz_int.h"
 #include "hmz.h"
@@ -15,26 +16,44 @@ buf_decode_code(const struct decode_buf * const buf, const unsigned int length)
 }
 
 static inline void
-buf_decode_fill(struct decode_buf * const buf, const unsigned char *data,
-    const unsigned bytes)
+buf_decode_fill(struct decode_buf * const buf, const unsigned char *data)
 {
 	unsigned long int bswap;
 
 	buf->buf_data = data;
 	memcpy(&bswap, data, 8);
 	buf->buf_val = __builtin_bswap64(bswap);
-	buf->buf_bits -= bytes << 3;
 }
 
 static inline void
 buf_decode_init(struct decode_buf * const buf,
     const unsigned char * const data, const unsigned int size)
 {
+	unsigned int bits;
+
 	buf->buf_val = 0;
 	buf->buf_bits = 0;
 	buf->buf_data = data;
 	buf->buf_end = data + size - 1 - 8;
 
+	/*
+	 * Streams too short for a full load are read once, right aligned
+	 * so that exactly their valid bits remain.
+	 */
+	if (size <= 9) {
+		buf->buf_end = data;
+		bits = 0;
+		if (size != 0) {
+			memcpy(&buf->buf_val, data, size - 1);
+			buf->buf_val = __builtin_bswap64(buf->buf_val);
+			bits = (size - 1) << 3;
+			bits = (data[size - 1] < bits) ? bits - data[size - 1] : 0;
+		}
+		buf->buf_bits = 64 - bits;
+		buf->buf_val = (bits != 0) ? buf->buf_val >> buf->buf_bits : 0;
+		return;
+	}
+
 	memcpy(&buf->buf_val, data, 8);
 	buf->buf_val = __builtin_bswap64(buf->buf_val);
 }
@@ -51,7 +70,12 @@ buf_decode_read_multi(struct decode_buf * const buf)
 	if (data >= buf->buf_end)
 		return 0;
 
-	buf_decode_fill(buf, data, bytes);
+	/*
+	 * Whole bytes were consumed, only the bit offset within the last
+	 * one remains.
+	 */
+	buf_decode_fill(buf, data);
+	buf->buf_bits &= 7;
 
 	return 1;
 }
@@ -79,7 +103,8 @@ buf_decode_read_one(struct decode_buf * const buf, const unsigned int length)
 		extra = *(buf->buf_end + 8);
 	}
 
-	buf_decode_fill(buf, data, bytes);
+	buf_decode_fill(buf, data);
+	buf->buf_bits -= bytes << 3;
 	buf->buf_bits += extra;
 	buf->buf_val >>= extra;
 
@@ -107,17 +132,168 @@ init_state(struct hmz_decode_state * const state,
 {
 	state->in = (unsigned char *)buffer_in;
 	state->out = buffer_out;
+	state->checked = buffer_out;
+	state->check = 0;
+	state->crc = 0;
+	state->range = 0;
+}
+
+/*
+ * Fold the output decoded since the last call into the checksum and hand
+ * it to the scan, a piece at a time while it is still in cache.
+ */
+static inline unsigned int
+decode_check(struct hmz_decode_state * const state)
+{
+	unsigned char *data = state->checked;
+	unsigned int error;
+	unsigned int size;
+
+	if (state->check == 0)
+		return 0;
+
+	for (; data < state->out; data += size) {
+		size = state->out - data;
+		if (size > SCAN_PIECE)
+			size = SCAN_PIECE;
+
+		if (state->check & CHECK_CRC)
+			state->crc = hmz_crc32c(state->crc, data, size);
+		if (state->check & CHECK_SCAN) {
+			error = state->scan(state->scan_arg, data, size);
+			if (error != 0) {
+				state->checked = data + size;
+				return error;
+			}
+		}
+	}
+
+	state->checked = state->out;
+	return 0;
+}
+
+/*
+ * The state holds one table.  Scratch for the features chunks of up to
+ * chunk_size bytes can use follows it: the other tables of the cache, the
+ * run lengths of a runs chunk, which take at most a byte more than the
+ * chunk, and a filtered chunk.  A chunk size of zero gives a state with
+ * none of it, which returns ENOMEM for runs and filtered chunks.
+ */
+static inline unsigned long
+decode_layout(struct hmz_decode_state * const state,
+    const unsigned int chunk_size)
+{
+	unsigned char * const mem = (unsigned char *)state;
+	unsigned long size = MEM_ROUND(sizeof(*state));
+	unsigned int cache_size = 1;
+	unsigned int runs_size = 0;
+	unsigned int filter_size = 0;
+	unsigned int i;
+
+	if (chunk_size != 0)
+		cache_size = TABLE_CACHE;
+	if (chunk_size >= RUNS_MIN)
+		runs_size = (chunk_size < RUNS_MAX - 1) ? chunk_size + 1 :
+		    RUNS_MAX;
+	if (chunk_size >= FILTER_MIN)
+		filter_size = (chunk_size < FILTER_MAX) ? chunk_size :
+		    FILTER_MAX;
+
+	if (state != NULL) {
+		state->tables[0] = state->first_table;
+		state->cache_size = cache_size;
+		state->runs = NULL;
+		state->filtered = NULL;
+		state->runs_size = runs_size;
+		state->filter_size = filter_size;
+	}
+
+	for (i = 1; i < cache_size; i++) {
+		if (state != NULL)
+			state->tables[i] = (struct decode *)(mem + size);
+		size += MEM_ROUND(TABLE_SIZE * sizeof(struct decode));
+	}
+	if (runs_size != 0) {
+		if (state != NULL)
+			state->runs = mem + size;
+		size += MEM_ROUND(runs_size);
+	}
+	if (filter_size != 0) {
+		if (state != NULL)
+			state->filtered = mem + size;
+		size += MEM_ROUND(filter_size);
+	}
+
+	return size;
+}
+
+static inline void
+init_cache(struct hmz_decode_state * const state)
+{
+	memset(state->cache, 0, sizeof(state->cache));
+	state->cache_clock = 0;
+	state->table = state->tables[0];
+	state->table_valid = 0;
+}
+
+/*
+ * Bytes of memory a state for chunks of up to chunk_size bytes takes,
+ * zero if the chunk size is invalid.
+ */
+unsigned int
+hmz_decode_state_size(const unsigned int chunk_size)
+{
+	if (chunk_size > HMZ_MAX_CHUNK)
+		return 0;
+
+	return decode_layout(NULL, chunk_size);
 }
 
 unsigned int
-hmz_decode_init(struct hmz_decode_state ** const state)
+hmz_decode_init(struct hmz_decode_state ** const state,
+    const unsigned int chunk_size)
 {
 	int error;
 
-	error = posix_memalign((void **)state, MEM_ALIGN, sizeof(**state));
+	if (chunk_size > HMZ_MAX_CHUNK)
+		return EINVAL;
+
+	error = posix_memalign((void **)state, MEM_ALIGN,
+	    decode_layout(NULL, chunk_size));
 	if (error != 0)
 		return ENOMEM;
 
+	decode_layout(*state, chunk_size);
+	init_cache(*state);
+	(*state)->cpu = hmz_cpu_features();
+	(*state)->owned = 1;
+
+	return 0;
+}
+
+/*
+ * Initialise a state in caller supplied memory of at least
+ * hmz_decode_state_size() bytes for the same chunk size, aligned to
+ * HMZ_STATE_ALIGN.  The memory remains owned by the caller,
+ * hmz_decode_finish() does not free it.
+ */
+unsigned int
+hmz_decode_init_mem(struct hmz_decode_state ** const state,
+    void * const mem, const unsigned int size, const unsigned int chunk_size)
+{
+	if (chunk_size > HMZ_MAX_CHUNK)
+		return EINVAL;
+
+	if (mem == NULL || size < decode_layout(NULL, chunk_size) ||
+	    ((uintptr_t)mem & (MEM_ALIGN - 1)) != 0)
+		return EINVAL;
+
+	*state = mem;
+	decode_layout(*state, chunk_size);
+	init_cache(*state);
+	(*state)->cpu = hmz_cpu_features();
+	(*state)->owned = 0;
+
 	return 0;
 }
 
@@ -158,17 +334,42 @@ decode_rle(struct hmz_decode_state * const state, unsigned int size_out)
 	return 0;
 }
 
-static inline void
+/*
+ * Bits of the code indexing the primary table.
+ */
+static inline unsigned int
+primary_bits(const unsigned int max_length)
+{
+	return (max_length < TABLE_BITS) ? max_length : TABLE_BITS;
+}
+
+/*
+ * Codes of up to TABLE_BITS are looked up directly in the primary table,
+ * up to three symbols an entry.  Longer codes are rare, their prefixes
+ * hold an entry with a count of 0 and the offset of a secondary table,
+ * after the primary one, indexed by the remaining bits.  The code space
+ * left by an incomplete or a broken header is filled with symbol 0 so
+ * every entry a stream can reach is valid.
+ */
+static inline unsigned int
 fill_table(struct hmz_decode_state * const state)
 {
+	const unsigned int bits = primary_bits(state->max_length);
+	const unsigned int extra = state->max_length - bits;
+	const unsigned int mask = (1U << extra) - 1;
+	struct decode * const primary_end = state->table + (1 << bits);
 	unsigned int ilength;
 	unsigned int jlength;
 	unsigned int klength;
+	unsigned int isymbol;
+	unsigned int jsymbol;
+	unsigned int pos;
 	unsigned int i;
 	unsigned int j;
 	unsigned int k;
 	struct decode entry;
 	struct decode *ptr;
+	struct decode *sub;
 	struct decode *iend;
 	struct decode *jend;
 	struct decode *kend;
@@ -176,67 +377,205 @@ fill_table(struct hmz_decode_state * const state)
 	ptr = state->table;
 	for (i = 0; i < state->symbol_count; i++) {
 		ilength = state->symbols[i].count;
-		entry.symbol[0] = state->symbols[i].symbol;
-		iend = ptr + (1 << (state->max_length - ilength));
+		if (ilength > bits)
+			break;
+		isymbol = state->symbols[i].symbol;
+		iend = ptr + (1 << (bits - ilength));
+		if (iend > primary_end)
+			return EIO;
 		for (j = 0; j < state->symbol_count; j++) {
 			jlength = ilength + state->symbols[j].count;
-			if (jlength > state->max_length)
+			if (jlength > bits)
+				break;
+			jsymbol = isymbol | state->symbols[j].symbol << 8;
+			jend = ptr + (1 << (bits - jlength));
+			if (jend > iend)
 				break;
-			entry.symbol[1] = state->symbols[j].symbol;
-			jend = ptr + (1 << (state->max_length - jlength));
 			for (k = 0; k < state->symbol_count; k++) {
 				klength = jlength + state->symbols[k].count;
-				if (klength > state->max_length)
+				if (klength > bits)
+					break;
+				entry.value = DECODE_ENTRY(jsymbol |
+				    state->symbols[k].symbol << 16, 3U,
+				    klength);
+				kend = ptr + (1 << (bits - klength));
+				if (kend > jend)
 					break;
-				entry.symbol[2] = state->symbols[k].symbol;
-				entry.count = 3;
-				entry.length = klength;
-				kend = ptr +
-				    (1 << (state->max_length - klength));
 				while (ptr < kend)
 					*ptr++ = entry;
 			}
-			entry.count = 2;
-			entry.length = jlength;
+			entry.value = DECODE_ENTRY(jsymbol, 2U, jlength);
 			while (ptr < jend)
 				*ptr++ = entry;
 		}
-		entry.count = 1;
-		entry.length = ilength;
+		entry.value = DECODE_ENTRY(isymbol, 1U, ilength);
 		while (ptr < iend)
 			*ptr++ = entry;
 	}
+
+	pos = (ptr - state->table) << extra;
+	sub = primary_end;
+	for (; i < state->symbol_count; i++) {
+		ilength = state->symbols[i].count;
+		if (ilength > state->max_length ||
+		    pos + (1U << (state->max_length - ilength)) >
+		    (1U << state->max_length))
+			return EIO;
+		if ((pos & mask) == 0)
+			state->table[pos >> extra].value = sub - state->table;
+		entry.value = DECODE_ENTRY(state->symbols[i].symbol, 1U,
+		    ilength);
+		kend = sub + (1 << (state->max_length - ilength));
+		while (sub < kend)
+			*sub++ = entry;
+		pos += 1U << (state->max_length - ilength);
+	}
+
+	entry.value = DECODE_ENTRY(0U, 1U, bits);
+	while ((pos & mask) != 0) {
+		*sub++ = entry;
+		pos++;
+	}
+
+	ptr = &state->table[pos >> extra];
+	while (ptr < primary_end)
+		*ptr++ = entry;
+
+	return 0;
+}
+
+static inline unsigned int
+table_hash(const unsigned int length, const unsigned char * const header,
+    const unsigned int size)
+{
+	unsigned long hash = length;
+	unsigned long v;
+	unsigned int i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&v, header + i, 8);
+		hash = (hash ^ v) * 0x9E3779B97F4A7C15UL;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ header[i]) * 0x9E3779B97F4A7C15UL;
+
+	return hash >> 32;
+}
+
+/*
+ * Built tables are kept keyed by the code length and the table header,
+ * so chunks repeating a header skip fill_table().  A miss rebuilds the
+ * least recently used table.
+ */
+static inline unsigned int
+select_table(struct hmz_decode_state * const state,
+    const unsigned char * const header, const unsigned int size)
+{
+	const unsigned int hash = table_hash(state->max_length, header, size);
+	struct decode_cache *slot;
+	unsigned int victim = 0;
+	unsigned int error;
+	unsigned int i;
+
+	state->cache_clock++;
+	for (i = 0; i < state->cache_size; i++) {
+		slot = &state->cache[i];
+		if (slot->hash == hash && slot->size == size &&
+		    slot->length == state->max_length &&
+		    memcmp(slot->key, header, size) == 0) {
+			slot->used = state->cache_clock;
+			state->table = state->tables[i];
+			return 0;
+		}
+		if (slot->used < state->cache[victim].used)
+			victim = i;
+	}
+
+	slot = &state->cache[victim];
+	state->table = state->tables[victim];
+	error = fill_table(state);
+
+	slot->size = 0;
+	slot->used = state->cache_clock;
+	if (error == 0 && size <= sizeof(slot->key)) {
+		slot->hash = hash;
+		slot->size = size;
+		slot->length = state->max_length;
+		memcpy(slot->key, header, size);
+	}
+
+	return error;
+}
+
+static inline unsigned int
+decode_count(const struct decode * const decode)
+{
+	return (decode->value >> DECODE_COUNT_SHIFT) & DECODE_COUNT_MASK;
+}
+
+/*
+ * Follow a primary entry with no symbols to the secondary table of a
+ * long code.  Kept out of line so the hot loops keep their registers.
+ */
+static __attribute__((noinline, cold)) const struct decode *
+decode_long(const struct hmz_decode_state * const state,
+    const struct decode_buf * const buf, const struct decode * const decode)
+{
+	const unsigned int length = state->max_length;
+	const unsigned int offset = decode->value & 0xFFFF;
+
+	return &state->table[offset +
+	    (buf_decode_code(buf, length) & ((1U << (length - TABLE_BITS)) - 1))];
+}
+
+/*
+ * Look up the code at the buffer's position.  Only tables with codes
+ * longer than TABLE_BITS are deep enough to have secondary tables.
+ */
+static inline const struct decode *
+decode_entry(const struct hmz_decode_state * const state,
+    const struct decode_buf * const buf, const unsigned int bits,
+    const unsigned int deep)
+{
+	const struct decode *decode;
+
+	decode = &state->table[buf_decode_code(buf, bits)];
+	if (deep == 0 || decode_count(decode) != 0)
+		return decode;
+	return decode_long(state, buf, decode);
 }
 
 static inline unsigned char *
 decode_one(const struct hmz_decode_state * const state,
-    struct decode_buf * const buf, const unsigned int length,
-    unsigned char * const out, const unsigned int * const lengths)
+    struct decode_buf * const buf, const unsigned int bits,
+    const unsigned int deep, unsigned char * const out,
+    const unsigned int * const lengths)
 {
 	const struct decode *decode;
 
-	decode = &state->table[buf_decode_code(buf, length)];
-	*out = decode->symbol[0];
-	buf_decode_consume(buf, lengths[decode->symbol[0]]);
+	decode = decode_entry(state, buf, bits, deep);
+	*out = decode->value;
+	buf_decode_consume(buf, lengths[*out]);
 	return out + 1;
 }
 
 static inline unsigned char *
 decode_multi(const struct hmz_decode_state * const state,
-    struct decode_buf * const buf, const unsigned int length,
-    unsigned char * const out)
+    struct decode_buf * const buf, const unsigned int bits,
+    const unsigned int deep, unsigned char * const out)
 {
 	const struct decode *decode;
 
-	decode = &state->table[buf_decode_code(buf, length)];
-	memcpy(out, decode->symbol, 4);
-	buf_decode_consume(buf, decode->length);
-	return out + decode->count;
+	decode = decode_entry(state, buf, bits, deep);
+	memcpy(out, &decode->value, 4);
+	buf_decode_consume(buf, decode->value >> DECODE_LENGTH_SHIFT);
+	return out + decode_count(decode);
 }
 
-static inline unsigned int
+static inline __attribute__((always_inline)) unsigned int
 decode_data_single(struct hmz_decode_state * const state,
-    const unsigned int size_in, const unsigned int size_out)
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int deep)
 {
 	unsigned char *out = state->out;
 	unsigned char *end = state->out + size_out;
@@ -244,8 +583,7 @@ decode_data_single(struct hmz_decode_state * const state,
 	unsigned int lengths[SYMBOLS];
 	unsigned int size;
 	const unsigned int length = state->max_length;
-
-	fill_table(state);
+	const unsigned int bits = primary_bits(length);
 
 	memcpy(&size, state->in, sizeof(size));
 	state->in += sizeof(size);
@@ -256,27 +594,28 @@ decode_data_single(struct hmz_decode_state * const state,
 	buf_decode_init(&buf, state->in, size);
 
 	while (out < (end-12) && buf_decode_read_multi(&buf)) {
-		out = decode_multi(state, &buf, length, out);
-		out = decode_multi(state, &buf, length, out);
-		out = decode_multi(state, &buf, length, out);
-		out = decode_multi(state, &buf, length, out);
+		out = decode_multi(state, &buf, bits, deep, out);
+		out = decode_multi(state, &buf, bits, deep, out);
+		out = decode_multi(state, &buf, bits, deep, out);
+		out = decode_multi(state, &buf, bits, deep, out);
 	}
 
 	while (out < (end-3) && buf_decode_read_multi(&buf))
-		out = decode_multi(state, &buf, length, out);
+		out = decode_multi(state, &buf, bits, deep, out);
 
 	memcpy(lengths, state->lengths, sizeof(state->lengths));
 
 	while (out < end && buf_decode_read_one(&buf, length))
-		out = decode_one(state, &buf, length, out, lengths);
+		out = decode_one(state, &buf, bits, deep, out, lengths);
 
 	state->out = out;
 	return buf_decode_end(&buf);
 }
 
-static inline unsigned int
+static inline __attribute__((always_inline)) unsigned int
 decode_data_multi(struct hmz_decode_state * const state,
-    const unsigned int size_in, const unsigned int size_out)
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int deep)
 {
 	struct decode_buf buf1;
 	struct decode_buf buf2;
@@ -293,18 +632,22 @@ decode_data_multi(struct hmz_decode_state * const state,
 	unsigned int lengths[SYMBOLS];
 	unsigned int sizes[5];
 	const unsigned int length = state->max_length;
+	const unsigned int bits = primary_bits(length);
 	unsigned int part;
 
-	fill_table(state);
+	if (size_in < sizeof(sizes))
+		return EIO;
 
 	memcpy(sizes, state->in, sizeof(sizes));
 	state->in += sizeof(sizes);
 
-	if (size_in <
-	    (sizeof(sizes) + sizes[1] + sizes[2] + sizes[3] + sizes[4]))
+	if (size_in - sizeof(sizes) < (unsigned long)sizes[1] + sizes[2] +
+	    sizes[3] + sizes[4])
 		return EIO;
 
 	part = sizes[0];
+	if ((unsigned long)part * 3 > size_out)
+		return EOVERFLOW;
 
 	buf_decode_init(&buf1, state->in, sizes[1]);
 	state->in += sizes[1];
@@ -331,230 +674,2360 @@ decode_data_multi(struct hmz_decode_state * const state,
 	    buf_decode_read_multi(&buf3) &&
 	    buf_decode_read_multi(&buf4)) {
 
-		out1 = decode_multi(state, &buf1, length, out1);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out4 = decode_multi(state, &buf4, length, out4);
-
-		out1 = decode_multi(state, &buf1, length, out1);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out4 = decode_multi(state, &buf4, length, out4);
-
-		out1 = decode_multi(state, &buf1, length, out1);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out4 = decode_multi(state, &buf4, length, out4);
-
-		out1 = decode_multi(state, &buf1, length, out1);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out4 = decode_multi(state, &buf4, length, out4);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
 	}
 
 	while (out1 < (end1-12) && buf_decode_read_multi(&buf1)) {
-		out1 = decode_multi(state, &buf1, length, out1);
-		out1 = decode_multi(state, &buf1, length, out1);
-		out1 = decode_multi(state, &buf1, length, out1);
-		out1 = decode_multi(state, &buf1, length, out1);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
 	}
 
 	while (out2 < (end2-12) && buf_decode_read_multi(&buf2)) {
-		out2 = decode_multi(state, &buf2, length, out2);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out2 = decode_multi(state, &buf2, length, out2);
-		out2 = decode_multi(state, &buf2, length, out2);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
 	}
 
 	while (out3 < (end3-12) && buf_decode_read_multi(&buf3)) {
-		out3 = decode_multi(state, &buf3, length, out3);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out3 = decode_multi(state, &buf3, length, out3);
-		out3 = decode_multi(state, &buf3, length, out3);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
 	}
 
 	while (out4 < (end4-12) && buf_decode_read_multi(&buf4)) {
-		out4 = decode_multi(state, &buf4, length, out4);
-		out4 = decode_multi(state, &buf4, length, out4);
-		out4 = decode_multi(state, &buf4, length, out4);
-		out4 = decode_multi(state, &buf4, length, out4);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
 	}
 
 	while (out1 < (end1-3) && buf_decode_read_multi(&buf1))
-		out1 = decode_multi(state, &buf1, length, out1);
+		out1 = decode_multi(state, &buf1, bits, deep, out1);
 
 	while (out2 < (end2-3) && buf_decode_read_multi(&buf2))
-		out2 = decode_multi(state, &buf2, length, out2);
+		out2 = decode_multi(state, &buf2, bits, deep, out2);
 
 	while (out3 < (end3-3) && buf_decode_read_multi(&buf3))
-		out3 = decode_multi(state, &buf3, length, out3);
+		out3 = decode_multi(state, &buf3, bits, deep, out3);
 
 	while (out4 < (end4-3) && buf_decode_read_multi(&buf4))
-		out4 = decode_multi(state, &buf4, length, out4);
+		out4 = decode_multi(state, &buf4, bits, deep, out4);
 
 	memcpy(lengths, state->lengths, sizeof(lengths));
 
 	while (out1 < end1 && buf_decode_read_one(&buf1, length))
-		out1 = decode_one(state, &buf1, length, out1, lengths);
+		out1 = decode_one(state, &buf1, bits, deep, out1, lengths);
 
 	while (out2 < end2 && buf_decode_read_one(&buf2, length))
-		out2 = decode_one(state, &buf2, length, out2, lengths);
+		out2 = decode_one(state, &buf2, bits, deep, out2, lengths);
 
 	while (out3 < end3 && buf_decode_read_one(&buf3, length))
-		out3 = decode_one(state, &buf3, length, out3, lengths);
+		out3 = decode_one(state, &buf3, bits, deep, out3, lengths);
 
 	while (out4 < end4 && buf_decode_read_one(&buf4, length))
-		out4 = decode_one(state, &buf4, length, out4, lengths);
+		out4 = decode_one(state, &buf4, bits, deep, out4, lengths);
 
 	state->out = out4;
 	return buf_decode_end(&buf1) | buf_decode_end(&buf2) |
 	    buf_decode_end(&buf3) | buf_decode_end(&buf4);
 }
 
-static inline unsigned int
-decode_data(struct hmz_decode_state * const state,
-    const unsigned int size_in, const unsigned int size_out)
+/*
+ * Read the header of interleaved streams, a width byte followed by the
+ * part size and each stream size in width bytes.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_streams_header(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int streams,
+    unsigned int * const sizes, unsigned int * const part)
 {
-	if (state->format == HMZ_FMT_SINGLE)
-		return decode_data_single(state, size_in, size_out);
-	else
-		return decode_data_multi(state, size_in, size_out);
+	unsigned long total;
+	unsigned int header;
+	unsigned int width;
+	unsigned int i;
+
+	if (size_in < 1)
+		return EIO;
+
+	width = *state->in;
+	header = 1 + width * (streams + 1);
+
+	if (width == 0 || width > 4 || size_in < header)
+		return EIO;
+
+	*part = 0;
+	memcpy(part, state->in + 1, width);
+
+	total = header;
+	for (i = 0; i < streams; i++) {
+		sizes[i] = 0;
+		memcpy(&sizes[i], state->in + 1 + (i + 1) * width, width);
+		total += sizes[i];
+	}
+
+	if (size_in < total)
+		return EIO;
+
+	state->in += header;
+	return 0;
 }
 
-static inline unsigned int
-decode_lens(struct hmz_decode_state * const state, const unsigned int size_in,
-    const unsigned int size_out)
+/*
+ * Set up a buffer and output range per stream.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_streams_init(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int streams, struct decode_buf * const bufs,
+    unsigned char ** const outs, const unsigned char ** const ends)
 {
-	const unsigned char *in = state->in;
-	unsigned int max_symbol;
+	unsigned int sizes[MAX_STREAMS];
+	unsigned int error;
+	unsigned int part;
 	unsigned int i;
-	unsigned int val;
-	unsigned int length;
-	unsigned int index;
-	unsigned int header_size;
-
-	max_symbol = *in++;
 
-	memset(state->code_counts, 0, sizeof(state->code_counts));
+	error = decode_streams_header(state, size_in, streams, sizes, &part);
+	if (error != 0)
+		return error;
+	if ((unsigned long)part * (streams - 1) > size_out)
+		return EOVERFLOW;
 
-	for (i = 0; i <= max_symbol; i += 2) {
-		val = *in++;
-		length = val >> 4;
-		state->lengths[i] = length;
-		state->code_counts[length]++;
-		length = val & 0xF;
-		state->lengths[i + 1] = length;
-		state->code_counts[length]++;
+	for (i = 0; i < streams; i++) {
+		buf_decode_init(&bufs[i], state->in, sizes[i]);
+		state->in += sizes[i];
+		outs[i] = state->out + i * part;
+		ends[i] = outs[i] + part;
 	}
+	ends[streams - 1] = state->out + size_out;
 
-	state->next_index[1] = 0;
-	for (i = 2; i <= state->max_length; i++)
-		state->next_index[i] = state->next_index[i - 1] +
-		    state->code_counts[i - 1];
-
-	state->next_index[0] = state->next_index[i - 1] +
-	    state->code_counts[i - 1];
+	return 0;
+}
 
-	state->symbol_count = state->next_index[0];
+/*
+ * The vector decoders keep a stream per lane: the byte and bit offset of
+ * its next code from the first stream, the last byte offset and the
+ * output offset from the first part.  A group of four steps reads at most
+ * 11 bytes past a lane's offset and writes at most 14 past its output,
+ * leaving a full load before buf_end for the scalar loops.
+ */
+static inline void
+lanes_init(struct decode_buf * const bufs, unsigned char ** const outs,
+    const unsigned char ** const ends, int lanes[5][MAX_STREAMS])
+{
+	const unsigned char * const in = bufs[0].buf_data;
+	unsigned int i;
 
-	for (i = 0; i <= max_symbol; i++) {
-		length = state->lengths[i];
-		index = state->next_index[length];
-		state->symbols[index].symbol = i;
-		state->symbols[index].count = length;
-		state->next_index[length]++;
+	for (i = 0; i < MAX_STREAMS; i++) {
+		lanes[0][i] = (bufs[i].buf_data - in) + (bufs[i].buf_bits >> 3);
+		lanes[1][i] = bufs[i].buf_bits & 7;
+		lanes[2][i] = (bufs[i].buf_end - in) - 8;
+		lanes[3][i] = outs[i] - outs[0];
+		lanes[4][i] = (ends[i] - outs[0]) - 14;
 	}
+}
 
-	header_size = in - state->in;
-	state->in = in;
+/*
+ * Leave the buffers as buf_decode_read_multi would for the scalar loops.
+ */
+static inline void
+lanes_finish(struct decode_buf * const bufs, unsigned char ** const outs,
+    int lanes[5][MAX_STREAMS])
+{
+	const unsigned char * const in = bufs[0].buf_data;
+	unsigned char * const out = outs[0];
+	unsigned int i;
 
-	return decode_data(state, size_in - header_size, size_out);
+	for (i = 0; i < MAX_STREAMS; i++) {
+		buf_decode_fill(&bufs[i], in + lanes[0][i]);
+		bufs[i].buf_bits = lanes[1][i];
+		outs[i] = out + lanes[3][i];
+	}
 }
 
-static inline unsigned int
-decode_canon(struct hmz_decode_state * const state, const unsigned int size_in,
-    const unsigned int size_out)
+/*
+ * Two steps of eight lanes from one gather of the streams, the four bytes
+ * hold at least 25 bits past the bit offset, enough for two codes of up
+ * to TABLE_BITS.  The symbols of both steps are joined into eight bytes
+ * a lane, written one lane at a time without a scatter.
+ */
+__attribute__((target("avx2")))
+static inline void
+decode_lanes_avx2(const struct decode * const table,
+    const unsigned char * const in, unsigned char * const out,
+    __m256i * const byte, __m256i * const bit, __m256i * const outs,
+    const __m128i primary)
 {
-	const unsigned char *in = state->in;
-	unsigned int val;
+	const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+	    11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4,
+	    11, 10, 9, 8, 15, 14, 13, 12);
+	const __m256i mask = _mm256_set1_epi32(DECODE_COUNT_MASK);
+	unsigned long joined[8];
+	unsigned int offsets[8];
+	__m256i symbols;
+	__m256i length;
+	__m256i second;
+	__m256i first;
+	__m256i count;
+	__m256i shift;
+	__m256i code;
+	__m256i pos;
+	__m256i lo;
+	__m256i hi;
 	unsigned int i;
-	unsigned int j;
-	unsigned int k;
-	unsigned int symbol;
-	unsigned int header_size;
 
-	state->code_counts[0] = 0;
-	for (i = 1; i <= state->max_length; i++)
-		state->code_counts[i] = *in++;
+	code = _mm256_i32gather_epi32((const int *)in, *byte, 1);
+	code = _mm256_sllv_epi32(_mm256_shuffle_epi8(code, bswap), *bit);
+	first = _mm256_i32gather_epi32((const int *)table,
+	    _mm256_srl_epi32(code, primary), 4);
+	length = _mm256_srli_epi32(first, DECODE_LENGTH_SHIFT);
+	code = _mm256_sllv_epi32(code, length);
+	second = _mm256_i32gather_epi32((const int *)table,
+	    _mm256_srl_epi32(code, primary), 4);
+
+	pos = _mm256_add_epi32(_mm256_add_epi32(*bit, length),
+	    _mm256_srli_epi32(second, DECODE_LENGTH_SHIFT));
+	*byte = _mm256_add_epi32(*byte, _mm256_srli_epi32(pos, 3));
+	*bit = _mm256_and_si256(pos, _mm256_set1_epi32(7));
+
+	count = _mm256_and_si256(_mm256_srli_epi32(first, DECODE_COUNT_SHIFT),
+	    mask);
+	shift = _mm256_slli_epi32(count, 3);
+	symbols = _mm256_andnot_si256(
+	    _mm256_sllv_epi32(_mm256_set1_epi32(-1), shift), first);
+
+	lo = _mm256_or_si256(_mm256_sllv_epi64(
+	    _mm256_cvtepu32_epi64(_mm256_castsi256_si128(second)),
+	    _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shift))),
+	    _mm256_cvtepu32_epi64(_mm256_castsi256_si128(symbols)));
+	hi = _mm256_or_si256(_mm256_sllv_epi64(
+	    _mm256_cvtepu32_epi64(_mm256_extracti128_si256(second, 1)),
+	    _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shift, 1))),
+	    _mm256_cvtepu32_epi64(_mm256_extracti128_si256(symbols, 1)));
+
+	_mm256_storeu_si256((__m256i *)&joined[0], lo);
+	_mm256_storeu_si256((__m256i *)&joined[4], hi);
+	_mm256_storeu_si256((__m256i *)offsets, *outs);
+	for (i = 0; i < 8; i++)
+		memcpy(out + offsets[i], &joined[i], 8);
+
+	count = _mm256_add_epi32(count, _mm256_and_si256(
+	    _mm256_srli_epi32(second, DECODE_COUNT_SHIFT), mask));
+	*outs = _mm256_add_epi32(*outs, count);
+}
 
-	k = 0;
-	for (i = 1; i <= state->max_length; i++) {
-		val = state->code_counts[i];
-		for (j = 0; j < val; j++) {
-			symbol = *in++;
-			state->symbols[k].symbol = symbol;
-			state->symbols[k].count = i;
-			state->lengths[symbol] = i;
-			k++;
-		}
+/*
+ * Decode 16 streams as two vectors of eight lanes while every stream has
+ * input and output left for four more steps.  Eight streams make a single
+ * chain of gathers, slower than the scalar loops.
+ */
+__attribute__((target("avx2")))
+static void
+decode_streams_avx2(const struct hmz_decode_state * const state,
+    struct decode_buf * const bufs, unsigned char ** const outs,
+    const unsigned char ** const ends)
+{
+	const unsigned char * const in = bufs[0].buf_data;
+	unsigned char * const out = outs[0];
+	const __m128i primary = _mm_cvtsi32_si128(32 -
+	    primary_bits(state->max_length));
+	int lanes[5][MAX_STREAMS];
+	__m256i byte[2];
+	__m256i bit[2];
+	__m256i last[2];
+	__m256i pos[2];
+	__m256i end[2];
+	__m256i more;
+	unsigned int steps = 0;
+	unsigned int g;
+
+	lanes_init(bufs, outs, ends, lanes);
+
+	for (g = 0; g < 2; g++) {
+		byte[g] = _mm256_loadu_si256((const __m256i *)&lanes[0][g * 8]);
+		bit[g] = _mm256_loadu_si256((const __m256i *)&lanes[1][g * 8]);
+		last[g] = _mm256_loadu_si256((const __m256i *)&lanes[2][g * 8]);
+		pos[g] = _mm256_loadu_si256((const __m256i *)&lanes[3][g * 8]);
+		end[g] = _mm256_loadu_si256((const __m256i *)&lanes[4][g * 8]);
 	}
 
-	state->symbol_count = k;
+	for (;;) {
+		more = _mm256_and_si256(
+		    _mm256_and_si256(_mm256_cmpgt_epi32(last[0], byte[0]),
+		    _mm256_cmpgt_epi32(end[0], pos[0])),
+		    _mm256_and_si256(_mm256_cmpgt_epi32(last[1], byte[1]),
+		    _mm256_cmpgt_epi32(end[1], pos[1])));
+		if (_mm256_movemask_epi8(more) != -1)
+			break;
 
-	header_size = in - state->in;
-	state->in = in;
+		decode_lanes_avx2(state->table, in, out, &byte[0], &bit[0],
+		    &pos[0], primary);
+		decode_lanes_avx2(state->table, in, out, &byte[1], &bit[1],
+		    &pos[1], primary);
+		decode_lanes_avx2(state->table, in, out, &byte[0], &bit[0],
+		    &pos[0], primary);
+		decode_lanes_avx2(state->table, in, out, &byte[1], &bit[1],
+		    &pos[1], primary);
+		steps++;
+	}
 
-	return decode_data(state, size_in - header_size, size_out);
+	if (steps == 0)
+		return;
+
+	for (g = 0; g < 2; g++) {
+		_mm256_storeu_si256((__m256i *)&lanes[0][g * 8], byte[g]);
+		_mm256_storeu_si256((__m256i *)&lanes[1][g * 8], bit[g]);
+		_mm256_storeu_si256((__m256i *)&lanes[3][g * 8], pos[g]);
+	}
+
+	lanes_finish(bufs, outs, lanes);
 }
 
-unsigned int
-hmz_decode(struct hmz_decode_state * const state,
-    const unsigned char * const buffer_in, const unsigned int size_in,
-    unsigned char * const buffer_out, unsigned int * const size_out)
+/*
+ * As decode_lanes_avx2 with sixteen lanes, the joined symbols scattered
+ * to the lanes' outputs.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static inline void
+decode_lanes_avx512(const struct decode * const table,
+    const unsigned char * const in, unsigned char * const out,
+    __m512i * const byte, __m512i * const bit, __m512i * const outs,
+    const __m128i primary)
 {
-	unsigned int tag;
-	unsigned int error;
+	const __m512i bswap = _mm512_broadcast_i32x4(_mm_setr_epi8(3, 2, 1, 0,
+	    7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12));
+	const __m512i mask = _mm512_set1_epi32(DECODE_COUNT_MASK);
+	__m512i symbols;
+	__m512i length;
+	__m512i second;
+	__m512i first;
+	__m512i count;
+	__m512i shift;
+	__m512i code;
+	__m512i pos;
+	__m512i lo;
+	__m512i hi;
+
+	code = _mm512_i32gather_epi32(*byte, in, 1);
+	code = _mm512_sllv_epi32(_mm512_shuffle_epi8(code, bswap), *bit);
+	first = _mm512_i32gather_epi32(_mm512_srl_epi32(code, primary),
+	    table, 4);
+	length = _mm512_srli_epi32(first, DECODE_LENGTH_SHIFT);
+	code = _mm512_sllv_epi32(code, length);
+	second = _mm512_i32gather_epi32(_mm512_srl_epi32(code, primary),
+	    table, 4);
+
+	pos = _mm512_add_epi32(_mm512_add_epi32(*bit, length),
+	    _mm512_srli_epi32(second, DECODE_LENGTH_SHIFT));
+	*byte = _mm512_add_epi32(*byte, _mm512_srli_epi32(pos, 3));
+	*bit = _mm512_and_si512(pos, _mm512_set1_epi32(7));
+
+	count = _mm512_and_si512(_mm512_srli_epi32(first, DECODE_COUNT_SHIFT),
+	    mask);
+	shift = _mm512_slli_epi32(count, 3);
+	symbols = _mm512_andnot_si512(
+	    _mm512_sllv_epi32(_mm512_set1_epi32(-1), shift), first);
+
+	lo = _mm512_or_si512(_mm512_sllv_epi64(
+	    _mm512_cvtepu32_epi64(_mm512_castsi512_si256(second)),
+	    _mm512_cvtepu32_epi64(_mm512_castsi512_si256(shift))),
+	    _mm512_cvtepu32_epi64(_mm512_castsi512_si256(symbols)));
+	hi = _mm512_or_si512(_mm512_sllv_epi64(
+	    _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(second, 1)),
+	    _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(shift, 1))),
+	    _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(symbols, 1)));
+
+	_mm512_i32scatter_epi64(out, _mm512_castsi512_si256(*outs), lo, 1);
+	_mm512_i32scatter_epi64(out, _mm512_extracti64x4_epi64(*outs, 1), hi,
+	    1);
+
+	count = _mm512_add_epi32(count, _mm512_and_si512(
+	    _mm512_srli_epi32(second, DECODE_COUNT_SHIFT), mask));
+	*outs = _mm512_add_epi32(*outs, count);
+}
 
-	if (state == NULL ||
-	    buffer_in == NULL || size_in < MIN_HEADER_SIZE ||
-	    buffer_out == NULL || *size_out == 0)
-		return EINVAL;
+/*
+ * Decode 16 streams in one vector, as decode_streams_avx2.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static void
+decode_streams_avx512(const struct hmz_decode_state * const state,
+    struct decode_buf * const bufs, unsigned char ** const outs,
+    const unsigned char ** const ends)
+{
+	const unsigned char * const in = bufs[0].buf_data;
+	unsigned char * const out = outs[0];
+	const __m128i primary = _mm_cvtsi32_si128(32 -
+	    primary_bits(state->max_length));
+	int lanes[5][MAX_STREAMS];
+	__m512i byte;
+	__m512i bit;
+	__m512i last;
+	__m512i pos;
+	__m512i end;
+	unsigned int steps = 0;
+
+	lanes_init(bufs, outs, ends, lanes);
+
+	byte = _mm512_loadu_si512(lanes[0]);
+	bit = _mm512_loadu_si512(lanes[1]);
+	last = _mm512_loadu_si512(lanes[2]);
+	pos = _mm512_loadu_si512(lanes[3]);
+	end = _mm512_loadu_si512(lanes[4]);
+
+	while ((_mm512_cmpgt_epi32_mask(last, byte) &
+	    _mm512_cmpgt_epi32_mask(end, pos)) == 0xFFFF) {
+		decode_lanes_avx512(state->table, in, out, &byte, &bit, &pos,
+		    primary);
+		decode_lanes_avx512(state->table, in, out, &byte, &bit, &pos,
+		    primary);
+		steps++;
+	}
 
-	init_state(state, buffer_in, buffer_out);
+	if (steps == 0)
+		return;
 
-	tag = *state->in;
-	state->format = (tag >> 4) & 3;
-	state->max_length = tag & 0xF;
-	tag >>= 6;
-	state->in++;
+	_mm512_storeu_si512(lanes[0], byte);
+	_mm512_storeu_si512(lanes[1], bit);
+	_mm512_storeu_si512(lanes[3], pos);
 
-	switch (tag)
-	{
-		case TAG_LITS:
-			error = decode_lits(state, size_in - 1, *size_out);
-			break;
-		case TAG_RLE:
-			error = decode_rle(state, *size_out);
-			break;
-		case TAG_LENS:
-			error = decode_lens(state, size_in - 1, *size_out);
-			break;
-		case TAG_CANON:
-			error = decode_canon(state, size_in - 1, *size_out);
-			break;
-		default:
-			error = EIO;
-			break;
-	}
+	lanes_finish(bufs, outs, lanes);
+}
 
-	*size_out = state->out - buffer_out;
-	return error;
+/*
+ * Decode 8 or 16 interleaved streams.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_data_streams(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int streams, const unsigned int deep)
+{
+	struct decode_buf bufs[MAX_STREAMS];
+	struct decode_buf *buf;
+	unsigned char *outs[MAX_STREAMS];
+	unsigned char *out;
+	const unsigned char *ends[MAX_STREAMS];
+	const unsigned char *end;
+	unsigned int lengths[SYMBOLS];
+	const unsigned int length = state->max_length;
+	const unsigned int bits = primary_bits(length);
+	unsigned int more;
+	unsigned int error;
+	unsigned int i;
+	unsigned int g;
+	unsigned int r;
+
+	error = decode_streams_init(state, size_in, size_out, streams, bufs,
+	    outs, ends);
+	if (error != 0)
+		return error;
+
+	if (streams == MAX_STREAMS && deep == 0) {
+		if (state->cpu & HMZ_CPU_AVX512)
+			decode_streams_avx512(state, bufs, outs, ends);
+		else if (state->cpu & HMZ_CPU_AVX2)
+			decode_streams_avx2(state, bufs, outs, ends);
+	}
+
+	for (;;) {
+		more = 1;
+		for (i = 0; i < streams; i++)
+			more &= (outs[i] < (ends[i]-12)) &
+			    buf_decode_read_multi(&bufs[i]);
+		if (more == 0)
+			break;
+
+		/*
+		 * Decode four streams at a time so their state can stay in
+		 * registers, the groups still overlap in the pipeline.
+		 */
+		for (g = 0; g < streams; g += 4) {
+			for (r = 0; r < 4; r++) {
+				for (i = g; i < g + 4; i++)
+					outs[i] = decode_multi(state, &bufs[i],
+					    bits, deep, outs[i]);
+			}
+		}
+	}
+
+	memcpy(lengths, state->lengths, sizeof(lengths));
+
+	error = 0;
+	for (i = 0; i < streams; i++) {
+		buf = &bufs[i];
+		out = outs[i];
+		end = ends[i];
+
+		while (out < (end-12) && buf_decode_read_multi(buf)) {
+			out = decode_multi(state, buf, bits, deep, out);
+			out = decode_multi(state, buf, bits, deep, out);
+			out = decode_multi(state, buf, bits, deep, out);
+			out = decode_multi(state, buf, bits, deep, out);
+		}
+
+		while (out < (end-3) && buf_decode_read_multi(buf))
+			out = decode_multi(state, buf, bits, deep, out);
+
+		while (out < end && buf_decode_read_one(buf, length))
+			out = decode_one(state, buf, bits, deep, out, lengths);
+
+		outs[i] = out;
+		error |= buf_decode_end(buf);
+	}
+
+	state->out = outs[streams - 1];
+	return error;
+}
+
+static inline unsigned char *
+decode_context_one(const struct decode_context * const table,
+    const unsigned short * const bases, struct decode_buf * const buf,
+    const unsigned int length, unsigned int * const base,
+    unsigned char * const out)
+{
+	const struct decode_context *entry;
+
+	entry = &table[*base + buf_decode_code(buf, length)];
+	*out = entry->symbol;
+	buf_decode_consume(buf, entry->length);
+	*base = bases[entry->symbol];
+	return out + 1;
+}
+
+/*
+ * Decode streams coded with a table per class of the previous byte.  Each
+ * symbol picks the next table so a lookup yields only one symbol, the
+ * streams are interleaved in groups of four to overlap the lookups.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_context_streams(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int streams)
+{
+	const struct decode_context * const table = state->context_table;
+	const unsigned short * const bases = state->context_base;
+	const unsigned int length = state->max_length;
+	struct decode_buf bufs[MAX_STREAMS];
+	struct decode_buf *buf;
+	unsigned char *outs[MAX_STREAMS];
+	unsigned char *out;
+	const unsigned char *ends[MAX_STREAMS];
+	const unsigned char *end;
+	unsigned int base[MAX_STREAMS];
+	const unsigned int group = (streams < 4) ? streams : 4;
+	unsigned int more;
+	unsigned int error;
+	unsigned int i;
+	unsigned int g;
+	unsigned int r;
+
+	error = decode_streams_init(state, size_in, size_out, streams, bufs,
+	    outs, ends);
+	if (error != 0)
+		return error;
+
+	for (i = 0; i < streams; i++)
+		base[i] = bases[0];
+
+	for (;;) {
+		more = 1;
+		for (i = 0; i < streams; i++)
+			more &= (outs[i] < (ends[i]-3)) &
+			    buf_decode_read_multi(&bufs[i]);
+		if (more == 0)
+			break;
+
+		for (g = 0; g < streams; g += group) {
+			for (r = 0; r < 4; r++) {
+				for (i = g; i < g + group; i++)
+					outs[i] = decode_context_one(table,
+					    bases, &bufs[i], length, &base[i],
+					    outs[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < streams; i++) {
+		buf = &bufs[i];
+		out = outs[i];
+		end = ends[i];
+
+		while (out < (end-3) && buf_decode_read_multi(buf)) {
+			out = decode_context_one(table, bases, buf, length,
+			    &base[i], out);
+			out = decode_context_one(table, bases, buf, length,
+			    &base[i], out);
+			out = decode_context_one(table, bases, buf, length,
+			    &base[i], out);
+			out = decode_context_one(table, bases, buf, length,
+			    &base[i], out);
+		}
+
+		while (out < end && buf_decode_read_one(buf, length))
+			out = decode_context_one(table, bases, buf, length,
+			    &base[i], out);
+
+		outs[i] = out;
+		error |= buf_decode_end(buf);
+	}
+
+	state->out = outs[streams - 1];
+	return error;
+}
+
+static inline __attribute__((always_inline)) unsigned int
+decode_data_depth(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int deep)
+{
+	switch (state->format)
+	{
+		case HMZ_FMT_SINGLE:
+			return decode_data_single(state, size_in, size_out,
+			    deep);
+		case HMZ_FMT_MULTI:
+			return decode_data_multi(state, size_in, size_out,
+			    deep);
+		case HMZ_FMT_MULTI8:
+			return decode_data_streams(state, size_in, size_out, 8,
+			    deep);
+		default:
+			return decode_data_streams(state, size_in, size_out,
+			    16, deep);
+	}
+}
+
+static inline __attribute__((always_inline)) unsigned int
+decode_data_format(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	if (state->max_length > TABLE_BITS)
+		return decode_data_depth(state, size_in, size_out, 1);
+	return decode_data_depth(state, size_in, size_out, 0);
+}
+
+static inline __attribute__((always_inline)) unsigned int
+decode_context_format(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int format)
+{
+	switch (format)
+	{
+		case HMZ_FMT_SINGLE:
+			return decode_context_streams(state, size_in, size_out,
+			    1);
+		case HMZ_FMT_MULTI:
+			return decode_context_streams(state, size_in, size_out,
+			    4);
+		case HMZ_FMT_MULTI8:
+			return decode_context_streams(state, size_in, size_out,
+			    8);
+		default:
+			return decode_context_streams(state, size_in, size_out,
+			    16);
+	}
+}
+
+/*
+ * Decode a stream from its start, dropping the first skip bytes into a
+ * small window and keeping the bytes after them up to end.
+ */
+static inline __attribute__((always_inline)) unsigned char *
+decode_stream_range(const struct hmz_decode_state * const state,
+    struct decode_buf * const buf, const unsigned int deep,
+    unsigned long skip, unsigned char *out, const unsigned char * const end)
+{
+	const unsigned int length = state->max_length;
+	const unsigned int bits = primary_bits(length);
+	unsigned char window[16];
+	unsigned char *drop;
+
+	while (skip > 12 && buf_decode_read_multi(buf)) {
+		drop = decode_multi(state, buf, bits, deep, window);
+		drop = decode_multi(state, buf, bits, deep, drop);
+		drop = decode_multi(state, buf, bits, deep, drop);
+		drop = decode_multi(state, buf, bits, deep, drop);
+		skip -= drop - window;
+	}
+
+	while (skip > 3 && buf_decode_read_multi(buf)) {
+		drop = decode_multi(state, buf, bits, deep, window);
+		skip -= drop - window;
+	}
+
+	while (skip > 0 && buf_decode_read_one(buf, length)) {
+		decode_one(state, buf, bits, deep, window, state->lengths);
+		skip--;
+	}
+
+	while (out < (end-12) && buf_decode_read_multi(buf)) {
+		out = decode_multi(state, buf, bits, deep, out);
+		out = decode_multi(state, buf, bits, deep, out);
+		out = decode_multi(state, buf, bits, deep, out);
+		out = decode_multi(state, buf, bits, deep, out);
+	}
+
+	while (out < (end-3) && buf_decode_read_multi(buf))
+		out = decode_multi(state, buf, bits, deep, out);
+
+	while (out < end && buf_decode_read_one(buf, length))
+		out = decode_one(state, buf, bits, deep, out, state->lengths);
+
+	return out;
+}
+
+/*
+ * Read the stream sizes of any format, a single stream has no part size.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_range_header(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int streams,
+    unsigned int * const sizes, unsigned int * const part)
+{
+	unsigned int multi[5];
+
+	switch (state->format)
+	{
+		case HMZ_FMT_SINGLE:
+			if (size_in < 4)
+				return EIO;
+			memcpy(sizes, state->in, 4);
+			state->in += 4;
+			*part = 0;
+			return (size_in - 4 < sizes[0]) ? EIO : 0;
+		case HMZ_FMT_MULTI:
+			if (size_in < sizeof(multi))
+				return EIO;
+			memcpy(multi, state->in, sizeof(multi));
+			state->in += sizeof(multi);
+			if (size_in - sizeof(multi) < (unsigned long)multi[1] +
+			    multi[2] + multi[3] + multi[4])
+				return EIO;
+			*part = multi[0];
+			memcpy(sizes, &multi[1], 4 * sizeof(*sizes));
+			return 0;
+		default:
+			return decode_streams_header(state, size_in, streams,
+			    sizes, part);
+	}
+}
+
+/*
+ * Decode output bytes state->offset to state->offset + size_out.  Stream
+ * i holds the part starting at i * part and the last the rest, each
+ * decodes on its own so only those overlapping the range are read.
+ */
+static inline __attribute__((always_inline)) unsigned int
+decode_range_depth(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int deep)
+{
+	const unsigned long first = state->offset;
+	const unsigned long last = first + size_out;
+	const unsigned int streams = FORMAT_STREAMS(state->format);
+	unsigned char * const out = state->out;
+	const unsigned char *data;
+	unsigned char *end;
+	struct decode_buf buf;
+	unsigned int sizes[MAX_STREAMS];
+	unsigned long start;
+	unsigned long stop;
+	unsigned int error;
+	unsigned int part;
+	unsigned int i;
+
+	error = decode_range_header(state, size_in, streams, sizes, &part);
+	if (error != 0)
+		return error;
+
+	data = state->in;
+	for (i = 0; i < streams; data += sizes[i], i++) {
+		start = (unsigned long)i * part;
+		stop = (i == streams - 1) ? last : start + part;
+		if (stop > last)
+			stop = last;
+		if (stop <= first)
+			continue;
+		if (start >= last)
+			break;
+
+		buf_decode_init(&buf, data, sizes[i]);
+		end = out + (stop - first);
+		state->out = decode_stream_range(state, &buf, deep,
+		    (first > start) ? first - start : 0, state->out, end);
+
+		/*
+		 * Only the last stream can end before the range does.
+		 */
+		if (state->out < end && i != streams - 1)
+			return EIO;
+	}
+
+	return 0;
+}
+
+static inline __attribute__((always_inline)) unsigned int
+decode_range_format(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	if (state->max_length > TABLE_BITS)
+		return decode_range_depth(state, size_in, size_out, 1);
+	return decode_range_depth(state, size_in, size_out, 0);
+}
+
+/*
+ * The same loops built for bmi2.  Every lookup shifts the bit buffer left
+ * by its position and right by the code length, shlx and shrx take both
+ * counts from any register without touching the flags so each is one uop
+ * rather than the three of a shift by cl.
+ */
+__attribute__((target("bmi,bmi2")))
+static unsigned int
+decode_data_bmi2(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	return decode_data_format(state, size_in, size_out);
+}
+
+__attribute__((target("bmi,bmi2")))
+static unsigned int
+decode_context_bmi2(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out,
+    const unsigned int format)
+{
+	return decode_context_format(state, size_in, size_out, format);
+}
+
+__attribute__((target("bmi,bmi2")))
+static unsigned int
+decode_range_bmi2(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	return decode_range_format(state, size_in, size_out);
+}
+
+static inline unsigned int
+decode_range(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	if (state->cpu & HMZ_CPU_BMI2)
+		return decode_range_bmi2(state, size_in, size_out);
+	return decode_range_format(state, size_in, size_out);
+}
+
+static inline unsigned int
+decode_data(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	if (state->range != 0)
+		return decode_range(state, size_in, size_out);
+	if (state->cpu & HMZ_CPU_BMI2)
+		return decode_data_bmi2(state, size_in, size_out);
+	return decode_data_format(state, size_in, size_out);
+}
+
+static inline unsigned int
+decode_lens(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	const unsigned char *in = state->in;
+	unsigned int max_symbol;
+	unsigned int i;
+	unsigned int val;
+	unsigned int length;
+	unsigned int index;
+	unsigned int header_size;
+	unsigned int error;
+
+	if (state->max_length > MAX_CODE_LEN)
+		return EIO;
+
+	max_symbol = *in++;
+
+	memset(state->code_counts, 0, sizeof(state->code_counts));
+
+	for (i = 0; i <= max_symbol; i += 2) {
+		val = *in++;
+		length = val >> 4;
+		state->lengths[i] = length;
+		state->code_counts[length]++;
+		length = val & 0xF;
+		state->lengths[i + 1] = length;
+		state->code_counts[length]++;
+	}
+
+	for (i = state->max_length + 1; i < 16; i++) {
+		if (state->code_counts[i] != 0)
+			return EIO;
+	}
+
+	state->next_index[1] = 0;
+	for (i = 2; i <= state->max_length; i++)
+		state->next_index[i] = state->next_index[i - 1] +
+		    state->code_counts[i - 1];
+
+	state->next_index[0] = state->next_index[i - 1] +
+	    state->code_counts[i - 1];
+
+	state->symbol_count = state->next_index[0];
+
+	for (i = 0; i <= max_symbol; i++) {
+		length = state->lengths[i];
+		index = state->next_index[length];
+		state->symbols[index].symbol = i;
+		state->symbols[index].count = length;
+		state->next_index[length]++;
+	}
+
+	header_size = in - state->in;
+	state->table_valid = 0;
+	error = select_table(state, state->in, header_size);
+	if (error != 0)
+		return error;
+	state->in = in;
+	state->table_valid = 1;
+
+	return decode_data(state, size_in - header_size, size_out);
+}
+
+static inline unsigned int
+decode_canon(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	const unsigned char *in = state->in;
+	unsigned int val;
+	unsigned int i;
+	unsigned int j;
+	unsigned int k;
+	unsigned int symbol;
+	unsigned int header_size;
+	unsigned int error;
+
+	if (state->max_length > MAX_CODE_LEN)
+		return EIO;
+
+	state->code_counts[0] = 0;
+	for (i = 1; i <= state->max_length; i++)
+		state->code_counts[i] = *in++;
+
+	k = 0;
+	for (i = 1; i <= state->max_length; i++) {
+		val = state->code_counts[i];
+		if (k + val > SYMBOLS)
+			return EIO;
+		for (j = 0; j < val; j++) {
+			symbol = *in++;
+			state->symbols[k].symbol = symbol;
+			state->symbols[k].count = i;
+			state->lengths[symbol] = i;
+			k++;
+		}
+	}
+
+	state->symbol_count = k;
+
+	header_size = in - state->in;
+	state->table_valid = 0;
+	error = select_table(state, state->in, header_size);
+	if (error != 0)
+		return error;
+	state->in = in;
+	state->table_valid = 1;
+
+	return decode_data(state, size_in - header_size, size_out);
+}
+
+static inline unsigned int
+decode_reuse(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	if (state->table_valid == 0)
+		return EIO;
+
+	return decode_data(state, size_in, size_out);
+}
+
+/*
+ * Fill one class's slice of the context table from its header.
+ */
+static inline unsigned int
+decode_context_table(struct hmz_decode_state * const state,
+    const unsigned int c, const unsigned int size_in)
+{
+	const unsigned char *in = state->in;
+	struct decode_context *ptr;
+	struct decode_context *end;
+	struct decode_context entry;
+	unsigned int code_counts[16];
+	unsigned int max_length;
+	unsigned int symbols;
+	unsigned int count;
+	unsigned int i;
+	unsigned int j;
+	unsigned int k;
+
+	if (size_in < 2)
+		return EIO;
+
+	symbols = *in++ + 1;
+	max_length = *in++;
+	if (max_length == 0 || max_length > state->max_length ||
+	    size_in < 2 + (max_length - 1) + symbols)
+		return EIO;
+
+	count = 0;
+	for (i = 1; i < max_length; i++) {
+		code_counts[i] = *in++;
+		count += code_counts[i];
+	}
+	if (count >= symbols)
+		return EIO;
+	code_counts[max_length] = symbols - count;
+
+	ptr = &state->context_table[c << state->max_length];
+	end = ptr + (1 << state->max_length);
+	for (i = 1; i <= max_length; i++) {
+		entry.length = i;
+		for (j = 0; j < code_counts[i]; j++) {
+			entry.symbol = *in++;
+			k = 1 << (state->max_length - i);
+			if (k > (unsigned int)(end - ptr))
+				return EIO;
+			while (k-- > 0)
+				*ptr++ = entry;
+		}
+	}
+
+	/*
+	 * A class of one symbol leaves the codes it doesn't use empty.
+	 */
+	entry.symbol = 0;
+	entry.length = state->max_length;
+	while (ptr < end)
+		*ptr++ = entry;
+
+	state->in = in;
+	return 0;
+}
+
+/*
+ * A context chunk holds the stream format and code length limit, the
+ * class count, the class of every previous byte packed in nibbles, a
+ * table per class and the streams.
+ */
+static inline unsigned int
+decode_context(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	const unsigned char * const start = state->in;
+	unsigned int classes;
+	unsigned int format;
+	unsigned int class;
+	unsigned int error;
+	unsigned int i;
+
+	if (size_in < CONTEXT_HEADER_SIZE - 2)
+		return EIO;
+
+	format = *state->in >> 4;
+	state->max_length = *state->in++ & 0xF;
+	classes = *state->in++;
+
+	if (format > HMZ_FMT_MASK || state->max_length == 0 ||
+	    state->max_length > CONTEXT_MAX_LEN || classes == 0 ||
+	    classes > CONTEXT_CLASSES ||
+	    (classes << state->max_length) > CONTEXT_ENTRIES)
+		return EIO;
+
+	for (i = 0; i < SYMBOLS; i++) {
+		class = (i & 1) ? *state->in++ & 0xF : *state->in >> 4;
+		if (class >= classes)
+			return EIO;
+		state->context_base[i] = class << state->max_length;
+	}
+
+	for (i = 0; i < classes; i++) {
+		error = decode_context_table(state, i,
+		    size_in - (state->in - start));
+		if (error != 0)
+			return error;
+	}
+
+	if (state->cpu & HMZ_CPU_BMI2)
+		return decode_context_bmi2(state,
+		    size_in - (state->in - start), size_out, format);
+	return decode_context_format(state, size_in - (state->in - start),
+	    size_out, format);
+}
+
+/*
+ * Spread each byte's low and high nibble (or half nibble) into a byte of
+ * their own, keeping them in order across the two 128 bit lanes.
+ */
+__attribute__((target("avx2")))
+static inline void
+unpack_halves(const __m256i v, const int shift, const __m256i mask,
+    __m256i * const first, __m256i * const second)
+{
+	const __m256i lo = _mm256_and_si256(v, mask);
+	const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, shift), mask);
+	const __m256i a = _mm256_unpacklo_epi8(lo, hi);
+	const __m256i b = _mm256_unpackhi_epi8(lo, hi);
+
+	*first = _mm256_permute2x128_si256(a, b, 0x20);
+	*second = _mm256_permute2x128_si256(a, b, 0x31);
+}
+
+/*
+ * Unpack 32 bytes at a time down to one index per byte, then map the
+ * indices to symbols with a byte shuffle.  Returns the bytes unpacked.
+ */
+__attribute__((target("avx2")))
+static unsigned int
+unpack_avx2(const unsigned char * const map, const unsigned char *in,
+    unsigned char *out, const unsigned int size, const unsigned int width)
+{
+	const __m256i symbols = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)map));
+	const __m256i nibble = _mm256_set1_epi8(0x0F);
+	const __m256i pair = _mm256_set1_epi8(0x03);
+	const __m256i bit = _mm256_set1_epi8(0x01);
+	const unsigned int block = 256 / width;
+	__m256i v[8];
+	__m256i t[4];
+	unsigned int done;
+	unsigned int n;
+	unsigned int i;
+
+	for (done = 0; done + block <= size; done += block) {
+		v[0] = _mm256_loadu_si256((const __m256i *)in);
+		in += 32;
+
+		unpack_halves(v[0], 4, nibble, &t[0], &t[1]);
+		n = 2;
+		if (width <= 2) {
+			unpack_halves(t[0], 2, pair, &v[0], &v[1]);
+			unpack_halves(t[1], 2, pair, &v[2], &v[3]);
+			n = 4;
+			if (width == 1) {
+				for (i = 0; i < 4; i++)
+					unpack_halves(v[3 - i], 1, bit,
+					    &v[6 - 2 * i], &v[7 - 2 * i]);
+				n = 8;
+			}
+		} else {
+			v[0] = t[0];
+			v[1] = t[1];
+		}
+
+		for (i = 0; i < n; i++)
+			_mm256_storeu_si256((__m256i *)(out + i * 32),
+			    _mm256_shuffle_epi8(symbols, v[i]));
+		out += block;
+	}
+
+	return done;
+}
+
+/*
+ * Expand each packed byte to its symbols through a table built for the
+ * chunk.
+ */
+static inline void
+unpack_generic(struct hmz_decode_state * const state,
+    const unsigned char * const map, const unsigned char *in,
+    unsigned char *out, const unsigned int size, const unsigned int width)
+{
+	const unsigned int per = 8 / width;
+	const unsigned int mask = (1U << width) - 1;
+	const unsigned char * const end = out + size;
+	unsigned long *table = state->bitpack_table;
+	unsigned long symbols;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < SYMBOLS; i++) {
+		symbols = 0;
+		for (j = 0; j < per; j++)
+			symbols |= (unsigned long)map[(i >> (j * width)) &
+			    mask] << (j * 8);
+		table[i] = symbols;
+	}
+
+	switch (width)
+	{
+		case 1:
+			for (; out + 8 <= end; out += 8)
+				memcpy(out, &table[*in++], 8);
+			break;
+		case 2:
+			for (; out + 4 <= end; out += 4)
+				memcpy(out, &table[*in++], 4);
+			break;
+		default:
+			for (; out + 2 <= end; out += 2)
+				memcpy(out, &table[*in++], 2);
+			break;
+	}
+
+	if (out < end)
+		memcpy(out, &table[*in], end - out);
+}
+
+/*
+ * Unpack output bytes state->offset to state->offset + size_out, starting
+ * from the byte holding the first of them.
+ */
+static inline void
+unpack_range(struct hmz_decode_state * const state,
+    const unsigned char * const map, const unsigned int size,
+    const unsigned int width, unsigned int size_out)
+{
+	const unsigned int per = 8 / width;
+	const unsigned char *in;
+	unsigned char first[8];
+	unsigned int skip;
+	unsigned int lead;
+
+	skip = (state->offset < size) ? state->offset : size;
+	if (size_out > size - skip)
+		size_out = size - skip;
+
+	in = state->in + skip / per;
+	lead = skip % per;
+	if (lead != 0 && size_out != 0) {
+		unpack_generic(state, map, in++, first, per, width);
+		lead = per - lead;
+		if (lead > size_out)
+			lead = size_out;
+		memcpy(state->out, first + skip % per, lead);
+		state->out += lead;
+		size_out -= lead;
+	}
+
+	if (size_out != 0)
+		unpack_generic(state, map, in, state->out, size_out, width);
+	state->out += size_out;
+}
+
+static inline unsigned int
+decode_bitpack(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	unsigned char map[BITPACK_SYMBOLS];
+	unsigned long packed;
+	unsigned int width;
+	unsigned int count;
+	unsigned int size;
+	unsigned int done = 0;
+
+	if (size_in < 2)
+		return EIO;
+
+	width = *state->in++;
+	count = *state->in++ + 1;
+	if ((width != 1 && width != 2 && width != 4) ||
+	    count > (1U << width) ||
+	    size_in < BITPACK_HEADER_SIZE(count) - 2)
+		return EIO;
+
+	memset(map, 0, sizeof(map));
+	memcpy(map, state->in, count);
+	state->in += count;
+	memcpy(&size, state->in, 4);
+	state->in += 4;
+
+	packed = ((unsigned long)size * width + 7) >> 3;
+	if (packed > size_in - (BITPACK_HEADER_SIZE(count) - 2))
+		return EIO;
+	if (state->range != 0) {
+		unpack_range(state, map, size, width, size_out);
+		return 0;
+	}
+	if (size > size_out)
+		return EOVERFLOW;
+
+	if (state->cpu & (HMZ_CPU_AVX2 | HMZ_CPU_AVX512))
+		done = unpack_avx2(map, state->in, state->out, size, width);
+
+	if (done < size)
+		unpack_generic(state, map, state->in + done * width / 8,
+		    state->out + done, size - done, width);
+
+	state->in += packed;
+	state->out += size;
+	return 0;
+}
+
+/*
+ * ANS streams are read backwards from their last bit.  The buffer holds
+ * the bits just before buf_pos, the last of them in its low bit.
+ */
+static inline void
+ans_buf_fill(struct ans_buf * const buf)
+{
+	unsigned long val = 0;
+	unsigned long start;
+
+	if (buf->buf_pos >= 64) {
+		start = (buf->buf_pos >> 3) - 7;
+		memcpy(&val, buf->buf_data + start, 8);
+		buf->buf_bits = buf->buf_pos - (start << 3);
+		buf->buf_val = __builtin_bswap64(val) >> (64 - buf->buf_bits);
+	} else {
+		memcpy(&val, buf->buf_data, (buf->buf_pos + 7) >> 3);
+		buf->buf_bits = buf->buf_pos;
+		buf->buf_val = (__builtin_bswap64(val) >> 1) >>
+		    (63 - buf->buf_bits);
+	}
+}
+
+static inline unsigned int
+ans_buf_init(struct ans_buf * const buf, const unsigned char * const data,
+    const unsigned int size)
+{
+	if (size == 0 || data[size - 1] > 7)
+		return EIO;
+
+	buf->buf_data = data;
+	buf->buf_pos = ((unsigned long)(size - 1) << 3) - data[size - 1];
+	if (buf->buf_pos > ((unsigned long)size << 3))
+		return EIO;
+
+	ans_buf_fill(buf);
+	return 0;
+}
+
+static inline unsigned int
+ans_buf_read(struct ans_buf * const buf, const unsigned int length)
+{
+	const unsigned int bits = buf->buf_val & ((1UL << length) - 1);
+
+	buf->buf_val >>= length;
+	buf->buf_bits -= length;
+	buf->buf_pos -= length;
+	return bits;
+}
+
+static inline unsigned char *
+decode_ans_one(const struct decode_ans * const table,
+    struct ans_buf * const buf, unsigned int * const value,
+    unsigned char * const out)
+{
+	const struct decode_ans * const entry = &table[*value];
+
+	*out = entry->symbol;
+	*value = entry->base + ans_buf_read(buf, entry->length);
+	return out + 1;
+}
+
+/*
+ * Spread the symbols over the table as the encoder did.  A slot holding
+ * the n'th occurrence of a symbol with count slots, x = count + n, reads
+ * enough bits to bring x << length back into the table.
+ */
+static inline unsigned int
+decode_ans_table(struct hmz_decode_state * const state, const unsigned int log,
+    const unsigned int count)
+{
+	const unsigned int slots = 1U << log;
+	const unsigned int step = (slots >> 1) + (slots >> 3) + 3;
+	struct decode_ans * const table = state->ans_table;
+	unsigned char symbols[SYMBOLS];
+	unsigned int next[SYMBOLS];
+	unsigned int total = 0;
+	unsigned int pos = 0;
+	unsigned int length;
+	unsigned int norm;
+	unsigned int x;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < count; i++) {
+		symbols[i] = state->in[0];
+		norm = 0;
+		memcpy(&norm, state->in + 1, 2);
+		state->in += 3;
+
+		if (norm == 0 || norm > slots - total)
+			return EIO;
+		next[i] = norm;
+		total += norm;
+
+		for (j = 0; j < norm; j++) {
+			table[pos].symbol = i;
+			pos = (pos + step) & (slots - 1);
+		}
+	}
+
+	if (total != slots)
+		return EIO;
+
+	for (i = 0; i < slots; i++) {
+		j = table[i].symbol;
+		x = next[j]++;
+		length = log - (31 - __builtin_clz(x));
+		table[i].symbol = symbols[j];
+		table[i].length = length;
+		table[i].base = (x << length) - slots;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode a group of streams four symbols at a time while each has them
+ * left and enough bits for a fill to cover them.  The group is a constant
+ * once inlined so its state can stay in registers.
+ */
+static inline __attribute__((always_inline)) void
+decode_ans_group(const struct decode_ans * const table,
+    struct ans_buf * const bufs, unsigned int * const values,
+    unsigned char ** const outs, const unsigned char ** const ends,
+    const unsigned int group)
+{
+	struct ans_buf buf[4];
+	unsigned int value[4];
+	unsigned char *out[4];
+	unsigned int more;
+	unsigned int i;
+	unsigned int r;
+
+	for (i = 0; i < group; i++) {
+		buf[i] = bufs[i];
+		value[i] = values[i];
+		out[i] = outs[i];
+	}
+
+	for (;;) {
+		more = 1;
+		for (i = 0; i < group; i++)
+			more &= (out[i] < (ends[i]-3)) &
+			    (buf[i].buf_pos >= 64);
+		if (more == 0)
+			break;
+
+		for (i = 0; i < group; i++)
+			ans_buf_fill(&buf[i]);
+
+		for (r = 0; r < 4; r++) {
+			for (i = 0; i < group; i++)
+				out[i] = decode_ans_one(table, &buf[i],
+				    &value[i], out[i]);
+		}
+	}
+
+	for (i = 0; i < group; i++) {
+		bufs[i] = buf[i];
+		values[i] = value[i];
+		outs[i] = out[i];
+	}
+}
+
+/*
+ * An ANS chunk holds the stream format and table log, the symbol count,
+ * each symbol with its slots, the chunk size and the streams.  Each stream
+ * starts from the state at its end and must finish in the state the
+ * encoder started from with every bit read.
+ */
+static inline unsigned int
+decode_ans(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	const struct decode_ans * const table = state->ans_table;
+	const unsigned char * const start = state->in;
+	struct ans_buf bufs[MAX_STREAMS];
+	struct ans_buf *buf;
+	unsigned char *outs[MAX_STREAMS];
+	unsigned char *out;
+	const unsigned char *ends[MAX_STREAMS];
+	const unsigned char *end;
+	unsigned int sizes[MAX_STREAMS];
+	unsigned int values[MAX_STREAMS];
+	unsigned int streams;
+	unsigned int format;
+	unsigned int count;
+	unsigned int log;
+	unsigned int size;
+	unsigned int part;
+	unsigned int error;
+	unsigned int i;
+
+	if (size_in < ANS_HEADER_SIZE(1) - 2)
+		return EIO;
+
+	format = *state->in >> 4;
+	log = *state->in++ & 0xF;
+	count = *state->in++ + 1;
+
+	if (format > HMZ_FMT_MASK || log < ANS_MIN_LOG || log > ANS_MAX_LOG ||
+	    size_in < ANS_HEADER_SIZE(count) - 2)
+		return EIO;
+
+	error = decode_ans_table(state, log, count);
+	if (error != 0)
+		return error;
+
+	memcpy(&size, state->in, 4);
+	state->in += 4;
+	if (size > size_out)
+		return EOVERFLOW;
+
+	streams = FORMAT_STREAMS(format);
+
+	error = decode_streams_header(state, size_in - (state->in - start),
+	    streams, sizes, &part);
+	if (error != 0)
+		return error;
+	if ((unsigned long)part * (streams - 1) > size)
+		return EIO;
+
+	for (i = 0; i < streams; i++) {
+		error = ans_buf_init(&bufs[i], state->in, sizes[i]);
+		if (error != 0 || bufs[i].buf_bits < log)
+			return EIO;
+		state->in += sizes[i];
+		values[i] = ans_buf_read(&bufs[i], log);
+		outs[i] = state->out + i * part;
+		ends[i] = outs[i] + part;
+	}
+	ends[streams - 1] = state->out + size;
+
+	if (streams == 1)
+		decode_ans_group(table, bufs, values, outs, ends, 1);
+	else {
+		for (i = 0; i < streams; i += 4)
+			decode_ans_group(table, &bufs[i], &values[i],
+			    &outs[i], &ends[i], 4);
+	}
+
+	for (i = 0; i < streams; i++) {
+		buf = &bufs[i];
+		out = outs[i];
+		end = ends[i];
+
+		while (out < end) {
+			if (buf->buf_bits < log)
+				ans_buf_fill(buf);
+			if (table[values[i]].length > buf->buf_bits)
+				return EIO;
+			out = decode_ans_one(table, buf, &values[i], out);
+		}
+
+		if (buf->buf_pos != 0 || values[i] != 0)
+			return EIO;
+	}
+
+	state->out += size;
+	return 0;
+}
+
+/*
+ * Undo a filter from element first on, gathering byte j of element i from
+ * in[j * elements + i] when shuffled and adding the same byte of the
+ * element before it when delta coded.
+ */
+static inline void
+unfilter_generic(const unsigned char * const in, unsigned char * const out,
+    const unsigned int elements, const unsigned int width,
+    const unsigned int filter, const unsigned int first)
+{
+	unsigned char v;
+	unsigned int i;
+	unsigned int j;
+
+	for (i = first; i < elements; i++) {
+		for (j = 0; j < width; j++) {
+			if (filter & FILTER_SHUFFLE)
+				v = in[j * elements + i];
+			else
+				v = in[i * width + j];
+			if ((filter & FILTER_DELTA) && i > 0)
+				v += out[(i - 1) * width + j];
+			out[i * width + j] = v;
+		}
+	}
+}
+
+/*
+ * Running sum of the bytes width apart within 16 bytes.
+ */
+__attribute__((target("avx2")))
+static inline __m128i
+unfilter_sum(__m128i v, const unsigned int width)
+{
+	switch (width)
+	{
+		case 1:
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 1));
+			/* fall through */
+		case 2:
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+			/* fall through */
+		case 4:
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+			/* fall through */
+		default:
+			v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+			break;
+	}
+
+	return v;
+}
+
+/*
+ * Rebuild 64 bytes of elements at a time, interleaving the planes with
+ * byte, word and dword unpacks and undoing the delta with a running sum
+ * carried from the last element of the previous 16 bytes.  Returns the
+ * elements done.
+ */
+__attribute__((target("avx2")))
+static inline unsigned int
+unfilter_avx2(const unsigned char * const in, unsigned char * const out,
+    const unsigned int elements, const unsigned int width,
+    const unsigned int filter)
+{
+	const unsigned int block = 64 / width;
+	const unsigned char *curr;
+	unsigned char last[16];
+	__m128i carry = _mm_setzero_si128();
+	__m128i broadcast;
+	__m128i r[8];
+	__m128i t[4];
+	unsigned int i;
+	unsigned int k;
+
+	for (k = 0; k < 16; k++)
+		last[k] = 16 - width + k % width;
+	broadcast = _mm_loadu_si128((const __m128i *)last);
+
+	for (i = 0; i + block <= elements; i += block) {
+		curr = in + i;
+		if (!(filter & FILTER_SHUFFLE)) {
+			for (k = 0; k < 4; k++)
+				r[k] = _mm_loadu_si128((const __m128i *)
+				    (in + i * width + 16 * k));
+		} else if (width == 2) {
+			for (k = 0; k < 2; k++) {
+				t[0] = _mm_loadu_si128((const __m128i *)
+				    (curr + 16 * k));
+				t[1] = _mm_loadu_si128((const __m128i *)
+				    (curr + elements + 16 * k));
+				r[2 * k] = _mm_unpacklo_epi8(t[0], t[1]);
+				r[2 * k + 1] = _mm_unpackhi_epi8(t[0], t[1]);
+			}
+		} else if (width == 4) {
+			for (k = 0; k < 4; k++)
+				r[k] = _mm_loadu_si128((const __m128i *)
+				    (curr + k * elements));
+			t[0] = _mm_unpacklo_epi8(r[0], r[1]);
+			t[1] = _mm_unpackhi_epi8(r[0], r[1]);
+			t[2] = _mm_unpacklo_epi8(r[2], r[3]);
+			t[3] = _mm_unpackhi_epi8(r[2], r[3]);
+			r[0] = _mm_unpacklo_epi16(t[0], t[2]);
+			r[1] = _mm_unpackhi_epi16(t[0], t[2]);
+			r[2] = _mm_unpacklo_epi16(t[1], t[3]);
+			r[3] = _mm_unpackhi_epi16(t[1], t[3]);
+		} else {
+			for (k = 0; k < 8; k++)
+				r[k] = _mm_loadl_epi64((const __m128i *)
+				    (curr + k * elements));
+			for (k = 0; k < 4; k++)
+				t[k] = _mm_unpacklo_epi8(r[2 * k],
+				    r[2 * k + 1]);
+			r[0] = _mm_unpacklo_epi16(t[0], t[1]);
+			r[1] = _mm_unpackhi_epi16(t[0], t[1]);
+			r[2] = _mm_unpacklo_epi16(t[2], t[3]);
+			r[3] = _mm_unpackhi_epi16(t[2], t[3]);
+			t[0] = _mm_unpacklo_epi32(r[0], r[2]);
+			t[1] = _mm_unpackhi_epi32(r[0], r[2]);
+			t[2] = _mm_unpacklo_epi32(r[1], r[3]);
+			t[3] = _mm_unpackhi_epi32(r[1], r[3]);
+			for (k = 0; k < 4; k++)
+				r[k] = t[k];
+		}
+
+		for (k = 0; k < 4; k++) {
+			if (filter & FILTER_DELTA) {
+				r[k] = _mm_add_epi8(unfilter_sum(r[k], width),
+				    carry);
+				carry = _mm_shuffle_epi8(r[k], broadcast);
+			}
+			_mm_storeu_si128((__m128i *)(out + i * width + 16 * k),
+			    r[k]);
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Bytes past the last whole element were delta coded unless shuffled.
+ */
+static inline void
+unfilter(const struct hmz_decode_state * const state,
+    const unsigned int filter, const unsigned int width,
+    const unsigned int size, unsigned char * const out)
+{
+	const unsigned char * const in = state->filtered;
+	const unsigned int elements = size / width;
+	unsigned int done = 0;
+	unsigned int i;
+
+	if ((state->cpu & (HMZ_CPU_AVX2 | HMZ_CPU_AVX512)) &&
+	    (width > 1 || !(filter & FILTER_SHUFFLE)))
+		done = unfilter_avx2(in, out, elements, width, filter);
+	unfilter_generic(in, out, elements, width, filter, done);
+
+	for (i = elements * width; i < size; i++) {
+		if (filter & FILTER_SHUFFLE)
+			out[i] = in[i];
+		else
+			out[i] = in[i] + out[i - width];
+	}
+}
+
+static inline unsigned int
+decode_block(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out);
+
+/*
+ * Read a run length, a byte below RUN_WORD or an escape followed by 2 or
+ * 4 bytes.  Returns 0 past the end of the lengths.
+ */
+static inline unsigned int
+runs_get(const unsigned char ** const run, const unsigned char * const end,
+    unsigned int * const length)
+{
+	const unsigned char *curr = *run;
+	unsigned int bytes;
+
+	if (curr >= end)
+		return 0;
+
+	*length = *curr++;
+	if (*length >= RUN_WORD) {
+		bytes = (*length == RUN_WORD) ? 2 : 4;
+		if (end - curr < bytes)
+			return 0;
+		*length = 0;
+		memcpy(length, curr, bytes);
+		curr += bytes;
+	}
+
+	*run = curr;
+	return 1;
+}
+
+/*
+ * Expand the runs in place.  The other bytes sit at the end of the
+ * output and each is read before the run and byte written in front of
+ * it, which can reach but never pass it.  Short runs are written with a
+ * single store when that stays clear of the bytes not yet read.
+ */
+static inline unsigned int
+runs_expand(unsigned char * const out, const unsigned int size,
+    const unsigned int lits, const unsigned char dominant,
+    const unsigned char *run, const unsigned char * const run_end)
+{
+	unsigned char * const end = out + size;
+	const unsigned char *lit = end - lits;
+	unsigned char *curr = out;
+	unsigned char fill[16];
+	unsigned int length;
+	unsigned char v;
+
+	memset(fill, dominant, sizeof(fill));
+
+	while (lit < end) {
+		if (!runs_get(&run, run_end, &length) ||
+		    length > (unsigned long)(lit - curr))
+			return EIO;
+
+		v = *lit++;
+		if (length <= sizeof(fill) &&
+		    (unsigned long)(lit - curr) >= sizeof(fill))
+			memcpy(curr, fill, sizeof(fill));
+		else
+			memset(curr, dominant, length);
+		curr += length;
+		*curr++ = v;
+	}
+
+	if (!runs_get(&run, run_end, &length) || run != run_end ||
+	    length != (unsigned long)(end - curr))
+		return EIO;
+	memset(curr, dominant, length);
+
+	return 0;
+}
+
+/*
+ * A run chunk holds the dominant byte, the chunk size, the count of other
+ * bytes and the compressed size of the run lengths, then the run lengths
+ * and the other bytes as blocks.  The lengths decode into state->runs and
+ * the other bytes into the end of the output.  Neither block may be a run
+ * chunk itself.
+ */
+static inline unsigned int
+decode_runs(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	unsigned char * const out = state->out;
+	const unsigned char *block;
+	unsigned char dominant;
+	unsigned int lits_size;
+	unsigned int runs_size;
+	unsigned int runs;
+	unsigned int lits;
+	unsigned int size;
+	unsigned int error;
+
+	if (size_in < RUNS_HEADER_SIZE - 2 + 2 * MIN_HEADER_SIZE)
+		return EIO;
+
+	dominant = *state->in++;
+	memcpy(&size, state->in, 4);
+	memcpy(&lits, state->in + 4, 4);
+	memcpy(&runs_size, state->in + 4 + 4, 4);
+	state->in += 4 + 4 + 4;
+
+	if (size > size_out)
+		return EOVERFLOW;
+	if (state->runs_size < RUNS_MAX && state->runs_size < size + 1)
+		return ENOMEM;
+	if (lits == 0 || lits > size || runs_size < MIN_HEADER_SIZE ||
+	    runs_size > size_in - (RUNS_HEADER_SIZE - 2) - MIN_HEADER_SIZE)
+		return EIO;
+	lits_size = size_in - (RUNS_HEADER_SIZE - 2) - runs_size;
+
+	block = state->in;
+	if (block[0] == EXT_TAG && block[1] == EXT_RUNS)
+		return EIO;
+	state->out = state->runs;
+	error = decode_block(state, runs_size, state->runs_size);
+	runs = state->out - state->runs;
+	if (error != 0)
+		goto out;
+
+	state->in = block + runs_size;
+	block = state->in;
+	if (block[0] == EXT_TAG && block[1] == EXT_RUNS)
+		return EIO;
+	state->out = out + size - lits;
+	error = decode_block(state, lits_size, lits);
+	if (error == 0 && state->out != out + size)
+		error = EIO;
+	if (error != 0)
+		goto out;
+
+	state->in = block + lits_size;
+	error = runs_expand(out, size, lits, dominant, state->runs,
+	    state->runs + runs);
+
+ out:
+	state->out = out + size;
+	return error;
+}
+
+static inline unsigned int
+decode_ext(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	unsigned int ext;
+
+	if (size_in < 1)
+		return EIO;
+
+	ext = *state->in++;
+
+	switch (ext)
+	{
+		case EXT_CONTEXT:
+			return decode_context(state, size_in - 1, size_out);
+		case EXT_BITPACK:
+			return decode_bitpack(state, size_in - 1, size_out);
+		case EXT_ANS:
+			return decode_ans(state, size_in - 1, size_out);
+		case EXT_RUNS:
+			return decode_runs(state, size_in - 1, size_out);
+		default:
+			return EIO;
+	}
+}
+
+/*
+ * Decode one block at state->in as a self contained chunk.
+ */
+static inline unsigned int
+decode_block(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	unsigned int tag;
+	unsigned int length;
+	unsigned int error;
+
+	tag = *state->in;
+	state->format = (tag >> 4) & 3;
+	length = tag & 0xF;
+	tag >>= 6;
+	state->in++;
+
+	switch (tag)
+	{
+		case TAG_LITS:
+			error = decode_lits(state, size_in - 1, size_out);
+			break;
+		case TAG_RLE:
+			error = decode_rle(state, size_out);
+			break;
+		case TAG_LENS:
+			if (length == EXT_LENGTH) {
+				error = decode_ext(state, size_in - 1, size_out);
+				break;
+			}
+			state->max_length = length;
+			error = decode_lens(state, size_in - 1, size_out);
+			break;
+		case TAG_CANON:
+			if (length == REUSE_LENGTH) {
+				error = decode_reuse(state, size_in - 1,
+				    size_out);
+				break;
+			}
+			state->max_length = length;
+			error = decode_canon(state, size_in - 1, size_out);
+			break;
+		default:
+			error = EIO;
+			break;
+	}
+
+	return error;
+}
+
+static inline unsigned int
+split_chunk(const unsigned char * const in)
+{
+	return in[0] == EXT_TAG && (in[1] == EXT_SPLIT || in[1] == EXT_INDEX);
+}
+
+/*
+ * A split chunk holds several blocks, each with its own table, preceded
+ * by their compressed sizes.  An indexed one follows those with the
+ * decoded sizes, which each block must fill.
+ */
+static inline unsigned int
+decode_split(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out, const unsigned int index)
+{
+	unsigned char * const out = state->out;
+	unsigned char *start;
+	const unsigned char *sizes;
+	const unsigned char *part;
+	unsigned int header;
+	unsigned int remain;
+	unsigned int parts;
+	unsigned int size;
+	unsigned int error;
+	unsigned int i;
+
+	if (size_in < 1)
+		return EIO;
+
+	parts = *state->in++;
+	header = index ? INDEX_HEADER_SIZE(parts) : SPLIT_HEADER_SIZE(parts);
+	if (parts < 2 || parts > SPLIT_BLOCKS || size_in < header - 2)
+		return EIO;
+
+	sizes = state->in;
+	state->in += header - 3;
+	remain = size_in - (header - 2);
+
+	for (i = 0; i < parts; i++) {
+		memcpy(&size, sizes + 4 * i, 4);
+		if (size < MIN_HEADER_SIZE || size > remain)
+			return EIO;
+
+		part = state->in;
+		start = state->out;
+		error = decode_block(state, size,
+		    size_out - (state->out - out));
+		if (error != 0)
+			return error;
+
+		state->in = part + size;
+		remain -= size;
+
+		error = decode_check(state);
+		if (error != 0)
+			return error;
+
+		if (index) {
+			memcpy(&size, sizes + 4 * (parts + i), 4);
+			if ((unsigned long)(state->out - start) != size)
+				return EIO;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * A filtered chunk is the filter and element width followed by a chunk
+ * of filtered bytes, which are decoded into state->filtered then copied
+ * out with the filter undone in the same pass.
+ */
+static inline unsigned int
+decode_filter(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	unsigned char * const out = state->out;
+	const unsigned int size_max = (size_out < state->filter_size) ?
+	    size_out : state->filter_size;
+	unsigned int filter;
+	unsigned int width;
+	unsigned int check;
+	unsigned int index;
+	unsigned int size;
+	unsigned int error;
+
+	if (size_in < 1 + 2)
+		return EIO;
+
+	filter = *state->in >> 4;
+	width = *state->in++ & 0xF;
+	if (filter == 0 || filter > (FILTER_DELTA | FILTER_SHUFFLE) ||
+	    width == 0 || width > 8 || (width & (width - 1)) != 0)
+		return EIO;
+	if (state->filtered == NULL)
+		return ENOMEM;
+
+	state->out = state->filtered;
+	check = state->check;
+	state->check = 0;
+	if (split_chunk(state->in)) {
+		index = state->in[1] == EXT_INDEX;
+		state->in += 2;
+		error = decode_split(state, size_in - 1 - 2, size_max, index);
+	} else
+		error = decode_block(state, size_in - 1, size_max);
+
+	size = state->out - state->filtered;
+	state->out = out;
+	state->check = check;
+	if (error == EOVERFLOW && size_max < size_out &&
+	    size_max < FILTER_MAX)
+		return ENOMEM;
+	if (error != 0)
+		return error;
+
+	unfilter(state, filter, width, size, out);
+	state->out = out + size;
+	return 0;
+}
+
+static inline unsigned int
+decode_chunk(struct hmz_decode_state * const state, const unsigned int size_in,
+    const unsigned int size_out)
+{
+	unsigned int index;
+
+	/*
+	 * Split and filtered chunks hold blocks so can only appear at the
+	 * top, a filtered chunk may hold a split chunk.
+	 */
+	if (split_chunk(state->in)) {
+		index = state->in[1] == EXT_INDEX;
+		state->in += 2;
+		return decode_split(state, size_in - 2, size_out, index);
+	}
+	if (state->in[0] == EXT_TAG && state->in[1] == EXT_FILTER) {
+		state->in += 2;
+		return decode_filter(state, size_in - 2, size_out);
+	}
+	return decode_block(state, size_in, size_out);
+}
+
+unsigned int
+hmz_decode(struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out)
+{
+	unsigned int error;
+
+	if (state == NULL ||
+	    buffer_in == NULL || size_in < MIN_HEADER_SIZE ||
+	    buffer_out == NULL || *size_out == 0)
+		return EINVAL;
+
+	init_state(state, buffer_in, buffer_out);
+	error = decode_chunk(state, size_in, *size_out);
+
+	*size_out = state->out - buffer_out;
+	return error;
+}
+
+/*
+ * Decode a chunk and return the CRC32C of its output.  The parts of a
+ * split chunk are summed as each is decoded and other chunks once
+ * decoded, so the output is checked while still in cache rather than in
+ * a second pass.
+ */
+unsigned int
+hmz_decode_crc(struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out,
+    unsigned int * const crc)
+{
+	unsigned int error;
+
+	if (state == NULL || crc == NULL ||
+	    buffer_in == NULL || size_in < MIN_HEADER_SIZE ||
+	    buffer_out == NULL || *size_out == 0)
+		return EINVAL;
+
+	init_state(state, buffer_in, buffer_out);
+	state->check = CHECK_CRC;
+	error = decode_chunk(state, size_in, *size_out);
+	decode_check(state);
+	state->check = 0;
+
+	*size_out = state->out - buffer_out;
+	*crc = state->crc;
+	return error;
+}
+
+/*
+ * Decode a chunk handing its output to scan in order, in pieces of at most
+ * SCAN_PIECE bytes, as each part of a split chunk or else the whole chunk
+ * is decoded.  A nonzero return from scan stops the decode and is
+ * returned.  The CRC32C of the output is set in crc unless it is NULL.
+ */
+unsigned int
+hmz_decode_scan(struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    unsigned char * const buffer_out, unsigned int * const size_out,
+    unsigned int (* const scan)(void *, const unsigned char *, unsigned int),
+    void * const arg, unsigned int * const crc)
+{
+	unsigned int error;
+
+	if (state == NULL || scan == NULL ||
+	    buffer_in == NULL || size_in < MIN_HEADER_SIZE ||
+	    buffer_out == NULL || *size_out == 0)
+		return EINVAL;
+
+	init_state(state, buffer_in, buffer_out);
+	state->check = CHECK_SCAN | ((crc != NULL) ? CHECK_CRC : 0);
+	state->scan = scan;
+	state->scan_arg = arg;
+	error = decode_chunk(state, size_in, *size_out);
+	if (error == 0)
+		error = decode_check(state);
+	state->check = 0;
+
+	*size_out = state->out - buffer_out;
+	if (crc != NULL)
+		*crc = state->crc;
+	return error;
+}
+
+/*
+ * Huffman and bitpacked blocks are decoded by range, literal and run
+ * blocks are copied directly.
+ */
+static inline unsigned int
+decode_range_block(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	const unsigned int tag = *state->in >> 6;
+	unsigned int size;
+
+	if (*state->in == EXT_TAG && state->in[1] != EXT_BITPACK)
+		return ENOTSUP;
+	if (tag != TAG_LITS && tag != TAG_RLE)
+		return decode_block(state, size_in, size_out);
+
+	memcpy(&size, state->in + 1 + (tag == TAG_RLE), 4);
+	if (tag == TAG_LITS && size > size_in - 1 - 4)
+		return EIO;
+
+	size = (state->offset < size) ? size - state->offset : 0;
+	if (size > size_out)
+		size = size_out;
+
+	if (tag == TAG_LITS)
+		memcpy(state->out, state->in + 1 + 4 + state->offset, size);
+	else
+		memset(state->out, state->in[1], size);
+	state->out += size;
+	return 0;
+}
+
+/*
+ * Blocks other than raw, run and reused ones carry a table header.
+ */
+static inline unsigned int
+block_table(const unsigned char * const block)
+{
+	const unsigned int tag = block[0] >> 6;
+
+	return (tag == TAG_LENS || tag == TAG_CANON) && (block[0] & 0xF) != 0;
+}
+
+/*
+ * Find the parts of an indexed split chunk holding the range from their
+ * decoded sizes and decode only those.  A part may reuse the table of the
+ * last one before it with a table, and the next chunk the last table of
+ * this one, so those are built without decoding the rest of their part.
+ */
+static inline unsigned int
+decode_range_split(struct hmz_decode_state * const state,
+    const unsigned int size_in, const unsigned int size_out)
+{
+	const unsigned long first = state->offset;
+	const unsigned long last = first + size_out;
+	unsigned char * const out = state->out;
+	const unsigned char *blocks[SPLIT_BLOCKS];
+	const unsigned char *sizes;
+	unsigned long starts[SPLIT_BLOCKS + 1];
+	unsigned long lo;
+	unsigned long hi;
+	unsigned int lengths[SPLIT_BLOCKS];
+	unsigned int remain;
+	unsigned int parts;
+	unsigned int size;
+	unsigned int error;
+	unsigned int before;
+	unsigned int after;
+	unsigned int i;
+
+	if (size_in < 1)
+		return EIO;
+
+	parts = *state->in++;
+	if (parts < 2 || parts > SPLIT_BLOCKS ||
+	    size_in < INDEX_HEADER_SIZE(parts) - 2)
+		return EIO;
+
+	sizes = state->in;
+	remain = size_in - (INDEX_HEADER_SIZE(parts) - 2);
+	blocks[0] = state->in + 8 * parts;
+	starts[0] = 0;
+	before = parts;
+	after = parts;
+
+	for (i = 0; i < parts; i++) {
+		memcpy(&lengths[i], sizes + 4 * i, 4);
+		memcpy(&size, sizes + 4 * (parts + i), 4);
+		if (lengths[i] < MIN_HEADER_SIZE || lengths[i] > remain)
+			return EIO;
+
+		remain -= lengths[i];
+		starts[i + 1] = starts[i] + size;
+		if (i + 1 < parts)
+			blocks[i + 1] = blocks[i] + lengths[i];
+
+		if (block_table(blocks[i]) && starts[i + 1] <= first)
+			before = i;
+		else if (block_table(blocks[i]) && starts[i] >= last)
+			after = i;
+	}
+
+	for (i = 0; i < parts; i++) {
+		state->in = blocks[i];
+		if (starts[i + 1] <= first || starts[i] >= last) {
+			if (i != before && i != after)
+				continue;
+			state->offset = 0;
+			error = decode_range_block(state, lengths[i], 0);
+		} else {
+			lo = (first > starts[i]) ? first : starts[i];
+			hi = (last < starts[i + 1]) ? last : starts[i + 1];
+			state->offset = lo - starts[i];
+			error = decode_range_block(state, lengths[i], hi - lo);
+			if (error == 0 && state->out != out + (hi - first))
+				error = EIO;
+		}
+		if (error != 0)
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode bytes offset to offset + *size_out of a chunk's output, setting
+ * *size_out to those decoded which is fewer if the chunk ends first.  Only
+ * the parts of a split chunk and the streams of a Huffman block holding
+ * the range are decoded, and only as far as it needs.  Context, ANS, run
+ * and filtered chunks return ENOTSUP and need hmz_decode().  A chunk
+ * reusing a table needs the chunk before it decoded, whole or by range.
+ */
+unsigned int
+hmz_decode_range(struct hmz_decode_state * const state,
+    const unsigned char * const buffer_in, const unsigned int size_in,
+    const unsigned int offset, unsigned char * const buffer_out,
+    unsigned int * const size_out)
+{
+	unsigned int error;
+
+	if (state == NULL || size_out == NULL ||
+	    buffer_in == NULL || size_in < MIN_HEADER_SIZE ||
+	    buffer_out == NULL || *size_out == 0)
+		return EINVAL;
+
+	init_state(state, buffer_in, buffer_out);
+	state->range = 1;
+	state->offset = offset;
+	if (state->in[0] == EXT_TAG && state->in[1] == EXT_INDEX) {
+		state->in += 2;
+		error = decode_range_split(state, size_in - 2, *size_out);
+	} else
+		error = decode_range_block(state, size_in, *size_out);
+	state->range = 0;
+
+	*size_out = state->out - buffer_out;
+	return error;
+}
+
+unsigned int
+hmz_decode_reset(struct hmz_decode_state * const state)
+{
+	if (state == NULL)
+		return EINVAL;
+
+	state->table_valid = 0;
+
+	return 0;
 }
 
 unsigned int
 hmz_decode_finish(const struct hmz_decode_state * const state)
 {
-	if (state != NULL)
+	if (state != NULL && state->owned != 0)
 		free((void *)state);
 
 	return 0;
@@ -0,0 +1,133 @@
+#include <sys/errno.h>
+#include <string.h>
+
+#include "hmz_int.h"
+#include "hmz.h"
+
+/*
+ * Scans for hmz_decode_scan.  Each is handed the decoded output in order a
+ * piece at a time, while it is still in cache, so nothing needs to be kept
+ * beyond the piece at hand.
+ */
+
+static inline void
+find_range(struct hmz_find * const find, const unsigned char * const data,
+    const unsigned int size, unsigned int limit, const unsigned long base)
+{
+	const unsigned char *match;
+	unsigned long start = 0;
+
+	if (size < find->length)
+		return;
+	if (limit > size - find->length + 1)
+		limit = size - find->length + 1;
+	if (find->next > base)
+		start = find->next - base;
+
+	while (start < limit) {
+		match = memchr(data + start, find->pattern[0], limit - start);
+		if (match == NULL)
+			break;
+
+		start = match - data;
+		if (memcmp(match + 1, find->pattern + 1, find->length - 1) != 0) {
+			start++;
+			continue;
+		}
+
+		if (find->matches == 0)
+			find->first = base + start;
+		find->matches++;
+		start += find->length;
+		find->next = base + start;
+	}
+}
+
+unsigned int
+hmz_find_init(struct hmz_find * const find,
+    const unsigned char * const pattern, const unsigned int length)
+{
+	if (find == NULL || pattern == NULL ||
+	    length == 0 || length > HMZ_FIND_MAX)
+		return EINVAL;
+
+	memset(find, 0, sizeof(*find));
+	find->pattern = pattern;
+	find->length = length;
+	find->first = ~0UL;
+	return 0;
+}
+
+/*
+ * Count the non-overlapping matches of the pattern.  The last length - 1
+ * bytes of each piece are carried into the next, so matches straddling
+ * two pieces are found by joining them with the start of the next piece.
+ */
+unsigned int
+hmz_scan_find(void * const arg, const unsigned char * const data,
+    const unsigned int size)
+{
+	struct hmz_find * const find = arg;
+	const unsigned int keep = find->length - 1;
+	unsigned char join[2 * HMZ_FIND_MAX];
+	unsigned int total;
+	unsigned int used;
+
+	used = (size < keep) ? size : keep;
+	memcpy(join, find->tail, find->carry);
+	memcpy(join + find->carry, data, used);
+	total = find->carry + used;
+
+	if (find->carry > 0)
+		find_range(find, join, total, find->carry,
+		    find->offset - find->carry);
+	find_range(find, data, size, size, find->offset);
+
+	if (size >= keep) {
+		memcpy(find->tail, data + size - keep, keep);
+		find->carry = keep;
+	} else {
+		used = (total > keep) ? total - keep : 0;
+		memcpy(find->tail, join + used, total - used);
+		find->carry = total - used;
+	}
+
+	find->offset += size;
+	return 0;
+}
+
+/*
+ * Add the byte counts of each piece to the unsigned long counts[256] in
+ * arg, spreading consecutive bytes over four lanes of counters.
+ */
+unsigned int
+hmz_scan_histogram(void * const arg, const unsigned char * const data,
+    const unsigned int size)
+{
+	unsigned long * const counts = arg;
+	unsigned int lanes[4][SYMBOLS];
+	unsigned long val;
+	unsigned int i;
+
+	memset(lanes, 0, sizeof(lanes));
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&val, data + i, sizeof(val));
+		lanes[0][val & 0xFF]++;
+		lanes[1][(val >> 8) & 0xFF]++;
+		lanes[2][(val >> 16) & 0xFF]++;
+		lanes[3][(val >> 24) & 0xFF]++;
+		lanes[0][(val >> 32) & 0xFF]++;
+		lanes[1][(val >> 40) & 0xFF]++;
+		lanes[2][(val >> 48) & 0xFF]++;
+		lanes[3][val >> 56]++;
+	}
+	for (; i < size; i++)
+		lanes[0][data[i]]++;
+
+	for (i = 0; i < SYMBOLS; i++)
+		counts[i] += lanes[0][i] + lanes[1][i] + lanes[2][i] +
+		    lanes[3][i];
+
+	return 0;
+}